@@ -0,0 +1,64 @@
+#ifndef libshrink__instantiate_hh
+#define libshrink__instantiate_hh
+
+#include <shrink/oneof.hh>
+
+// Explicit instantiation of the value nodes behind a OneOf, so that their
+// vtables and member functions are compiled once rather than in every
+// translation unit that uses the OneOf. Put
+//
+//     SHRINK_EXTERN_ONEOF(int, std::string)
+//
+// in a header after the OneOf's types are complete, and
+//
+//     SHRINK_INSTANTIATE_ONEOF(int, std::string)
+//
+// in exactly one source file. The arguments are the OneOf's types without a
+// storage policy, in the same order; the nodes are shared by every policy.
+// Types whose names contain commas need a typedef first. Up to 16 types are
+// supported.
+
+#define SHRINK_ONEOF_UNPAREN(...) __VA_ARGS__
+
+#define SHRINK_ONEOF_COUNT(...) \
+    SHRINK_ONEOF_COUNT_N(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, )
+#define SHRINK_ONEOF_COUNT_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+
+#define SHRINK_ONEOF_CONCAT(a, b) SHRINK_ONEOF_CONCAT_(a, b)
+#define SHRINK_ONEOF_CONCAT_(a, b) a##b
+
+#define SHRINK_ONEOF_EACH(m, types, ...) \
+    SHRINK_ONEOF_CONCAT(SHRINK_ONEOF_EACH_, SHRINK_ONEOF_COUNT(__VA_ARGS__))(m, types, __VA_ARGS__)
+
+#define SHRINK_ONEOF_EACH_1(m, types, t) m(types, t)
+#define SHRINK_ONEOF_EACH_2(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_1(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_3(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_2(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_4(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_3(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_5(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_4(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_6(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_5(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_7(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_6(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_8(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_7(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_9(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_8(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_10(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_9(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_11(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_10(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_12(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_11(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_13(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_12(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_14(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_13(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_15(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_14(m, types, __VA_ARGS__)
+#define SHRINK_ONEOF_EACH_16(m, types, t, ...) m(types, t) SHRINK_ONEOF_EACH_15(m, types, __VA_ARGS__)
+
+#define SHRINK_ONEOF_EXTERN_VALUE(types, t) \
+    extern template struct shrink::oneof_internal::OneOfValue<t, SHRINK_ONEOF_UNPAREN types>;
+
+#define SHRINK_ONEOF_INSTANTIATE_VALUE(types, t) \
+    template struct shrink::oneof_internal::OneOfValue<t, SHRINK_ONEOF_UNPAREN types>;
+
+#define SHRINK_EXTERN_ONEOF(...) \
+    extern template struct shrink::oneof_internal::OneOfValueBase<__VA_ARGS__>; \
+    SHRINK_ONEOF_EACH(SHRINK_ONEOF_EXTERN_VALUE, (__VA_ARGS__), __VA_ARGS__)
+
+#define SHRINK_INSTANTIATE_ONEOF(...) \
+    template struct shrink::oneof_internal::OneOfValueBase<__VA_ARGS__>; \
+    SHRINK_ONEOF_EACH(SHRINK_ONEOF_INSTANTIATE_VALUE, (__VA_ARGS__), __VA_ARGS__)
+
+#endif
@@ -1,15 +1,45 @@
 #ifndef libshrink__oneof_hh
 #define libshrink__oneof_hh
 
+#include <atomic>
+#include <cstddef>
 #include <string>
 #include <memory>
+#include <functional>
+#include <new>
+#include <stdexcept>
 #include <type_traits>
 #include <utility>
 
 #include <shrink/storage_policy.hh>
 
+#if defined(__GNUC__)
+#  define SHRINK_LIKELY(...) __builtin_expect(!!(__VA_ARGS__), 1)
+#  define SHRINK_UNLIKELY(...) __builtin_expect(!!(__VA_ARGS__), 0)
+#  define SHRINK_NOINLINE __attribute__((noinline))
+#else
+#  define SHRINK_LIKELY(...) (__VA_ARGS__)
+#  define SHRINK_UNLIKELY(...) (__VA_ARGS__)
+#  define SHRINK_NOINLINE
+#endif
+
 namespace shrink
 {
+    namespace exceptions
+    {
+        struct EmptyOneOfException : std::runtime_error
+        {
+            EmptyOneOfException()
+                : std::runtime_error("Attempted to visit an empty OneOf with no handler for Empty")
+            { }
+        };
+    }
+
+    // Parameter type for a when() handler to be called on an empty OneOf
+    struct Empty
+    {
+    };
+
     namespace oneof_internal
     {
         struct UnknownTypeForOneOf;
@@ -33,6 +63,45 @@ namespace shrink
                     >::type Type;
         };
 
+        template <typename Want_, typename... Types_>
+        struct IsOneOfType :
+            std::integral_constant<bool, ! std::is_same<typename SelectOneOfType<Want_, Types_...>::Type, UnknownTypeForOneOf>::value>
+        {
+        };
+
+        template <typename Want_, typename... Types_>
+        struct IndexOfType;
+
+        template <typename Want_, typename... Rest_>
+        struct IndexOfType<Want_, Want_, Rest_...> :
+            std::integral_constant<std::size_t, 0>
+        {
+        };
+
+        template <typename Want_, typename Try_, typename... Rest_>
+        struct IndexOfType<Want_, Try_, Rest_...> :
+            std::integral_constant<std::size_t, 1 + IndexOfType<Want_, Rest_...>::value>
+        {
+        };
+
+        template <typename... Types_>
+        struct TypeList;
+
+        template <typename List_, typename... Wants_>
+        struct AreAllOneOfTypes;
+
+        template <typename... Types_>
+        struct AreAllOneOfTypes<TypeList<Types_...> > :
+            std::true_type
+        {
+        };
+
+        template <typename... Types_, typename Want_, typename... Rest_>
+        struct AreAllOneOfTypes<TypeList<Types_...>, Want_, Rest_...> :
+            std::integral_constant<bool, IsOneOfType<Want_, Types_...>::value && AreAllOneOfTypes<TypeList<Types_...>, Rest_...>::value>
+        {
+        };
+
         template <typename Type_>
         struct ParameterTypes;
 
@@ -123,6 +192,7 @@ namespace shrink
             virtual void accept(OneOfVisitor<Types_...> &) = 0;
             virtual void accept(OneOfVisitor<const Types_...> &) const = 0;
             virtual OneOfValueBase * clone() = 0;
+            virtual std::size_t index() const = 0;
         };
 
         template <typename... Types_>
@@ -139,6 +209,11 @@ namespace shrink
             {
             }
 
+            OneOfValue(Type_ && type)
+                : value(std::move(type))
+            {
+            }
+
             OneOfValue(const OneOfValue & other)
                 : value(other.value)
             {
@@ -158,6 +233,236 @@ namespace shrink
             {
                 return new OneOfValue(*this);
             }
+
+            virtual std::size_t index() const
+            {
+                return IndexOfType<Type_, Types_...>::value;
+            }
+        };
+
+        enum class ConvertMode
+        {
+            copy,
+            move,
+            rebind
+        };
+
+        // Builds a value node for Targets_..., allocated by Storage_, out of a
+        // node for Sources_... holding the same Type_. Both nodes are a vtable
+        // pointer plus a Type_, so a node that nobody else can see can be
+        // rebuilt in place rather than reallocated.
+        //
+        // Rebuilding can't just swap the vtable pointer: the payload is moved
+        // out to a temporary and back in, so it costs two moves of Type_
+        // where ConvertMode::move costs one, in exchange for skipping an
+        // allocation and a free. The source has already given up the node by
+        // then, so it's only done when moving Type_ can't throw.
+        template <typename Storage_, typename Target_, typename Source_>
+        struct OneOfConverter;
+
+        template <typename Storage_, typename... Targets_, typename... Sources_>
+        struct OneOfConverter<Storage_, OneOfValueBase<Targets_...>, OneOfValueBase<Sources_...> >
+        {
+            typedef OneOfValueBase<Targets_...> Target;
+            typedef OneOfValueBase<Sources_...> Source;
+            typedef Target * (* Function)(Source *, ConvertMode);
+
+            template <typename Type_>
+            static Target * convert(Source * source, ConvertMode mode)
+            {
+                typedef OneOfValue<Type_, Sources_...> From;
+                typedef OneOfValue<Type_, Targets_...> To;
+
+                static_assert(sizeof(From) == sizeof(To) && alignof(From) == alignof(To),
+                        "OneOf value nodes for the same type must share a layout");
+
+                From * from = static_cast<From *>(source);
+
+                switch (mode)
+                {
+                    case ConvertMode::copy:
+                        return Storage_::template make<To>(static_cast<const Type_ &>(from->value));
+
+                    case ConvertMode::move:
+                        return Storage_::template make<To>(std::move(from->value));
+
+                    case ConvertMode::rebind:
+                        break;
+                }
+
+                Type_ value(std::move(from->value));
+                from->~From();
+                return new (static_cast<void *>(from)) To(std::move(value));
+            }
+
+            template <typename Type_>
+            static Function find_function(std::true_type)
+            {
+                return &convert<Type_>;
+            }
+
+            template <typename Type_>
+            static Function find_function(std::false_type)
+            {
+                return nullptr;
+            }
+
+            template <typename... Types_>
+            struct FindVisit;
+
+            template <typename Dummy_>
+            struct FindVisit<Dummy_> :
+                OneOfVisitor<const Sources_...>
+            {
+                Function function = nullptr;
+                bool rebindable = false;
+            };
+
+            template <typename Dummy_, typename Type_, typename... Rest_>
+            struct FindVisit<Dummy_, Type_, Rest_...> :
+                FindVisit<Dummy_, Rest_...>
+            {
+                virtual void visit(const Type_ &)
+                {
+                    this->function = find_function<Type_>(IsOneOfType<Type_, Targets_...>());
+                    this->rebindable = std::is_nothrow_move_constructible<Type_>::value;
+                }
+            };
+
+            // Returns null if the value held by source isn't one of Targets_...
+            // Sets rebindable if the function may be given ConvertMode::rebind.
+            static Function find(const Source & source, bool & rebindable)
+            {
+                FindVisit<void, Sources_...> visitor;
+                source.accept(visitor);
+                rebindable = visitor.rebindable;
+                return visitor.function;
+            }
+
+            static Function find(const Source & source)
+            {
+                bool rebindable;
+                return find(source, rebindable);
+            }
+        };
+
+        // Finds the held value if it's a Want_, without any allocation
+        template <typename Want_, typename Value_>
+        struct OneOfFinder;
+
+        template <typename Want_, typename... Types_>
+        struct OneOfFinder<Want_, OneOfValueBase<Types_...> >
+        {
+            static Want_ * matching(Want_ & t, std::true_type)
+            {
+                return &t;
+            }
+
+            template <typename Type_>
+            static Want_ * matching(Type_ &, std::false_type)
+            {
+                return nullptr;
+            }
+
+            template <typename... Rest_>
+            struct FindVisit;
+
+            template <typename Dummy_>
+            struct FindVisit<Dummy_> :
+                OneOfVisitor<Types_...>
+            {
+                Want_ * found = nullptr;
+            };
+
+            template <typename Dummy_, typename Type_, typename... Rest_>
+            struct FindVisit<Dummy_, Type_, Rest_...> :
+                FindVisit<Dummy_, Rest_...>
+            {
+                virtual void visit(Type_ & t)
+                {
+                    this->found = matching(t, std::is_same<Type_, Want_>());
+                }
+            };
+
+            static Want_ * find(OneOfValueBase<Types_...> & value)
+            {
+                FindVisit<void, Types_...> visitor;
+                value.accept(visitor);
+                return visitor.found;
+            }
+        };
+
+        template <typename Type_>
+        bool assign_in_place(Type_ * held, const Type_ & value, std::true_type)
+        {
+            *held = value;
+            return true;
+        }
+
+        template <typename Type_>
+        bool assign_in_place(Type_ *, const Type_ &, std::false_type)
+        {
+            return false;
+        }
+
+        // Copies the value held by a node for Sources_... into a node for
+        // Targets_..., if the target already holds a value of the same type
+        template <typename Target_, typename Source_>
+        struct OneOfAssigner;
+
+        template <typename... Targets_, typename... Sources_>
+        struct OneOfAssigner<OneOfValueBase<Targets_...>, OneOfValueBase<Sources_...> >
+        {
+            typedef OneOfValueBase<Targets_...> Target;
+            typedef bool (* Function)(Target &, const void *);
+
+            template <typename Type_>
+            static bool assign(Target & target, const void * value)
+            {
+                Type_ * held = OneOfFinder<Type_, Target>::find(target);
+                return held && assign_in_place(held, *static_cast<const Type_ *>(value), std::is_copy_assignable<Type_>());
+            }
+
+            template <typename Type_>
+            static Function find_function(std::true_type)
+            {
+                return &assign<Type_>;
+            }
+
+            template <typename Type_>
+            static Function find_function(std::false_type)
+            {
+                return nullptr;
+            }
+
+            template <typename... Types_>
+            struct AssignVisit;
+
+            template <typename Dummy_>
+            struct AssignVisit<Dummy_> :
+                OneOfVisitor<const Sources_...>
+            {
+                Function function = nullptr;
+                const void * value = nullptr;
+            };
+
+            template <typename Dummy_, typename Type_, typename... Rest_>
+            struct AssignVisit<Dummy_, Type_, Rest_...> :
+                AssignVisit<Dummy_, Rest_...>
+            {
+                virtual void visit(const Type_ & t)
+                {
+                    this->function = find_function<Type_>(IsOneOfType<Type_, Targets_...>());
+                    this->value = &t;
+                }
+            };
+
+            static bool assign(Target & target, const OneOfValueBase<Sources_...> & source)
+            {
+                AssignVisit<void, Sources_...> visitor;
+                source.accept(visitor);
+                return visitor.function && visitor.function(target, visitor.value);
+            }
         };
 
         template <typename Policy_, typename Value_> struct OneOfStorage;
@@ -171,11 +476,22 @@ namespace shrink
             const Value_ & operator*() const { return *_storage; }
 
             OneOfStorage(Value_ * v) : _storage(v) { }
-            OneOfStorage(OneOfStorage && other) : _storage(std::move(other._storage)) { }
+            OneOfStorage(OneOfStorage && other) noexcept : _storage(std::move(other._storage)) { }
             OneOfStorage(const OneOfStorage &) = delete;
             OneOfStorage & operator= (const OneOfStorage &) = delete;
+            OneOfStorage & operator= (OneOfStorage && other) noexcept { _storage = std::move(other._storage); return *this; }
 
             void reset(Value_* v) { _storage.reset(v); }
+            bool empty() const { return ! _storage; }
+
+            static constexpr bool owns_nodes = true;
+
+            template <typename Node_, typename... Args_>
+            static Node_ * make(Args_ && ... args) { return new Node_(std::forward<Args_>(args)...); }
+
+            static constexpr bool copies_value = true;
+            Value_ * release_unshared() { return _storage.release(); }
+            bool unshared() const { return true; }
         };
 
         template <typename Value_>
@@ -187,11 +503,25 @@ namespace shrink
             const Value_ & operator*() const { return *_storage; }
 
             OneOfStorage(Value_ * v) : _storage(v) { }
-            OneOfStorage(OneOfStorage && other) : _storage(std::move(other._storage)) { }
+            OneOfStorage(OneOfStorage && other) noexcept : _storage(std::move(other._storage)) { }
             OneOfStorage(const OneOfStorage & other) : _storage(other._storage) { }
-            OneOfStorage & operator= (const OneOfStorage & other) { _storage = other._storage; }
+            OneOfStorage & operator= (const OneOfStorage & other) { _storage = other._storage; return *this; }
+            OneOfStorage & operator= (OneOfStorage && other) noexcept { _storage = std::move(other._storage); return *this; }
 
             void reset(Value_* v) { _storage.reset(v); }
+            bool empty() const { return ! _storage; }
+
+            static constexpr bool owns_nodes = true;
+
+            template <typename Node_, typename... Args_>
+            static Node_ * make(Args_ && ... args) { return new Node_(std::forward<Args_>(args)...); }
+
+            // Copying a OneOf shares its node rather than copying the value into ours
+            static constexpr bool copies_value = false;
+
+            // A shared_ptr can't give up ownership of its node, even when it's the only one
+            Value_ * release_unshared() { return nullptr; }
+            bool unshared() const { return _storage.use_count() == 1; }
         };
 
         template <typename Value_>
@@ -203,23 +533,85 @@ namespace shrink
             const Value_ & operator*() const { return *_storage; }
 
             OneOfStorage(Value_ * v) : _storage(v) { }
-            OneOfStorage(OneOfStorage && other) : _storage(std::move(other._storage)) { }
-            OneOfStorage(const OneOfStorage & other) : _storage(other._storage->clone()) { }
-            OneOfStorage & operator= (const OneOfStorage & other) { _storage = other._storage->clone(); }
+            OneOfStorage(OneOfStorage && other) noexcept : _storage(std::move(other._storage)) { }
+            OneOfStorage(const OneOfStorage & other) : _storage(other._storage ? other._storage->clone() : nullptr) { }
+            OneOfStorage & operator= (const OneOfStorage & other) { _storage.reset(other._storage ? other._storage->clone() : nullptr); return *this; }
+            OneOfStorage & operator= (OneOfStorage && other) noexcept { _storage = std::move(other._storage); return *this; }
 
             void reset(Value_* v) { _storage.reset(v); }
+            bool empty() const { return ! _storage; }
+
+            static constexpr bool owns_nodes = true;
+
+            template <typename Node_, typename... Args_>
+            static Node_ * make(Args_ && ... args) { return new Node_(std::forward<Args_>(args)...); }
+
+            static constexpr bool copies_value = true;
+            Value_ * release_unshared() { return _storage.release(); }
+            bool unshared() const { return true; }
         };
 
         template <typename Policy_, typename... Types_>
         class OneOfImpl
         {
             private:
-                oneof_internal::OneOfStorage<Policy_, oneof_internal::OneOfValueBase<Types_...> > _value;
+                typedef oneof_internal::OneOfValueBase<Types_...> Value;
+                typedef oneof_internal::OneOfStorage<Policy_, Value> Storage;
+
+                Storage _value;
+
+                template <typename, typename...> friend class OneOfImpl;
+
+                // Returns null if other is empty or holds a type that isn't one of Types_...
+                template <typename OtherPolicy_, typename... OtherTypes_>
+                static Value * converted(const OneOfImpl<OtherPolicy_, OtherTypes_...> & other)
+                {
+                    if (other.empty())
+                        return nullptr;
+
+                    typedef OneOfConverter<Storage, Value, OneOfValueBase<OtherTypes_...> > Converter;
+
+                    typename Converter::Function convert = Converter::find(other.value());
+                    if (! convert)
+                        return nullptr;
+
+                    return convert(const_cast<OneOfValueBase<OtherTypes_...> *>(&other.value()), ConvertMode::copy);
+                }
+
+                template <typename OtherPolicy_, typename... OtherTypes_>
+                static Value * converted(OneOfImpl<OtherPolicy_, OtherTypes_...> && other)
+                {
+                    if (other.empty())
+                        return nullptr;
+
+                    typedef OneOfConverter<Storage, Value, OneOfValueBase<OtherTypes_...> > Converter;
+
+                    bool rebindable;
+                    typename Converter::Function convert = Converter::find(other.value(), rebindable);
+                    if (! convert)
+                        return nullptr;
+
+                    if (Storage::owns_nodes && rebindable)
+                        if (OneOfValueBase<OtherTypes_...> * node = other._value.release_unshared())
+                            return convert(node, ConvertMode::rebind);
+
+                    // A moved-from OneOf is empty, however its value was taken
+                    Value * result = convert(&other.value(), other._value.unshared() ? ConvertMode::move : ConvertMode::copy);
+                    other.reset();
+                    return result;
+                }
 
             public:
+                // An empty OneOf holds no value and costs no allocation. when() on
+                // an empty OneOf calls a handler taking shrink::Empty, if given.
+                OneOfImpl()
+                    : _value(nullptr)
+                {
+                }
+
                 template <typename Type_>
                 OneOfImpl(const Type_ & value)
-                    : _value(new oneof_internal::OneOfValue<typename oneof_internal::SelectOneOfType<Type_, Types_...>::Type, Types_...>{value})
+                    : _value(Storage::template make<oneof_internal::OneOfValue<typename oneof_internal::SelectOneOfType<Type_, Types_...>::Type, Types_...> >(value))
                 {
                 }
 
@@ -228,29 +620,121 @@ namespace shrink
                 {
                 }
 
-                OneOfImpl(OneOfImpl && other)
+                OneOfImpl(OneOfImpl && other) noexcept
                     : _value(std::move(other._value))
                 {
                 }
 
+                // Widening conversions from a OneOf whose types are all among ours.
+                // Converting from an rvalue reuses its value node where possible.
+                template <typename OtherPolicy_, typename... OtherTypes_>
+                OneOfImpl(const OneOfImpl<OtherPolicy_, OtherTypes_...> & other)
+                    : _value(converted(other))
+                {
+                    static_assert(AreAllOneOfTypes<TypeList<Types_...>, OtherTypes_...>::value,
+                            "Can only convert from a OneOf whose types are all in the target; use try_convert");
+                }
+
+                template <typename OtherPolicy_, typename... OtherTypes_>
+                OneOfImpl(OneOfImpl<OtherPolicy_, OtherTypes_...> && other)
+                    : _value(converted(std::move(other)))
+                {
+                    static_assert(AreAllOneOfTypes<TypeList<Types_...>, OtherTypes_...>::value,
+                            "Can only convert from a OneOf whose types are all in the target; use try_convert");
+                }
+
+                // Assigning a value of the type we already hold assigns into the
+                // existing node rather than replacing it, unless it's shared.
                 template <typename Type_>
                 OneOfImpl & operator= (const Type_ & value)
                 {
-                    _value.reset(new oneof_internal::OneOfValue<typename oneof_internal::SelectOneOfType<Type_, Types_...>::Type, Types_...>{value});
+                    typedef typename oneof_internal::SelectOneOfType<Type_, Types_...>::Type Selected;
+
+                    if (! empty() && _value.unshared())
+                        if (Selected * held = OneOfFinder<Selected, Value>::find(*_value))
+                            if (assign_in_place(held, value, std::is_copy_assignable<Selected>()))
+                                return *this;
+
+                    _value.reset(Storage::template make<oneof_internal::OneOfValue<Selected, Types_...> >(value));
                     return *this;
                 }
 
                 OneOfImpl & operator= (const OneOfImpl & other)
                 {
+                    if (_value.copies_value && this != &other && ! empty() && ! other.empty())
+                        if (OneOfAssigner<Value, Value>::assign(*_value, *other._value))
+                            return *this;
+
                     _value = other._value;
+                    return *this;
                 }
 
-                OneOfImpl & operator= (OneOfImpl && other)
+                OneOfImpl & operator= (OneOfImpl && other) noexcept
                 {
                     _value = std::move(other._value);
                     return *this;
                 }
 
+                template <typename OtherPolicy_, typename... OtherTypes_>
+                OneOfImpl & operator= (const OneOfImpl<OtherPolicy_, OtherTypes_...> & other)
+                {
+                    static_assert(AreAllOneOfTypes<TypeList<Types_...>, OtherTypes_...>::value,
+                            "Can only convert from a OneOf whose types are all in the target; use try_convert");
+
+                    if (! empty() && ! other.empty() && _value.unshared())
+                        if (OneOfAssigner<Value, OneOfValueBase<OtherTypes_...> >::assign(*_value, *other._value))
+                            return *this;
+
+                    _value.reset(converted(other));
+                    return *this;
+                }
+
+                template <typename OtherPolicy_, typename... OtherTypes_>
+                OneOfImpl & operator= (OneOfImpl<OtherPolicy_, OtherTypes_...> && other)
+                {
+                    static_assert(AreAllOneOfTypes<TypeList<Types_...>, OtherTypes_...>::value,
+                            "Can only convert from a OneOf whose types are all in the target; use try_convert");
+                    _value.reset(converted(std::move(other)));
+                    return *this;
+                }
+
+                // Assigns from other if the type it holds is one of ours, otherwise
+                // returns false and leaves both sides untouched.
+                template <typename Other_>
+                bool try_assign(Other_ && other)
+                {
+                    if (other.empty())
+                    {
+                        reset();
+                        return true;
+                    }
+
+                    if (Value * v = converted(std::forward<Other_>(other)))
+                    {
+                        _value.reset(v);
+                        return true;
+                    }
+                    return false;
+                }
+
+                static constexpr std::size_t size = sizeof...(Types_);
+
+                bool empty() const
+                {
+                    return _value.empty();
+                }
+
+                // The position in Types_... of the type held, or size if empty
+                std::size_t index() const
+                {
+                    return empty() ? sizeof...(Types_) : value().index();
+                }
+
+                void reset()
+                {
+                    _value.reset(nullptr);
+                }
+
                 oneof_internal::OneOfValueBase<Types_...> & value()
                 {
                     return *_value;
@@ -262,6 +746,9 @@ namespace shrink
                 }
         };
 
+        template <typename Policy_, typename... Types_>
+        constexpr std::size_t OneOfImpl<Policy_, Types_...>::size;
+
         template <typename Visitor_, typename Result_, typename OneOf_>
         struct OneOfVisitorWrapperTypeFinder;
 
@@ -277,10 +764,38 @@ namespace shrink
             typedef OneOfVisitorWrapper<Visitor_, Result_, Types_...> Type;
         };
 
+        template <typename Visitor_>
+        struct HasEmptyVisit
+        {
+            template <typename V_>
+            static auto test(int) -> decltype(std::declval<V_ &>().visit(std::declval<Empty &>()), std::true_type());
+
+            template <typename V_>
+            static std::false_type test(...);
+
+            typedef decltype(test<Visitor_>(0)) Type;
+        };
+
+        template <typename Result_, typename Visitor_>
+        Result_ visit_empty(Visitor_ & visitor, std::true_type)
+        {
+            Empty empty;
+            return visitor.visit(empty);
+        }
+
+        template <typename Result_, typename Visitor_>
+        Result_ visit_empty(Visitor_ &, std::false_type)
+        {
+            throw exceptions::EmptyOneOfException();
+        }
+
         template <typename Result_, typename OneOf_, typename Visitor_>
         Result_
         accept_returning(OneOf_ && one_of, Visitor_ && visitor)
         {
+            if (one_of.empty())
+                return visit_empty<Result_>(visitor, typename HasEmptyVisit<typename std::remove_reference<Visitor_>::type>::Type());
+
             typename OneOfVisitorWrapperTypeFinder<Visitor_, Result_, OneOf_>::Type visitor_wrapper(visitor);
             one_of.value().accept(visitor_wrapper);
             return visitor_wrapper.execute();
@@ -321,6 +836,274 @@ namespace shrink
             using LambdaVisitor<Result_, Rest_...>::visit;
         };
 
+        // Like LambdaVisitor, but owns copies of the lambdas so that it can be
+        // stored and shared. The lambdas are only ever called through const.
+        template <typename Result_, typename... Funcs_>
+        struct StoredLambdaVisitor;
+
+        template <typename Result_>
+        struct StoredLambdaVisitor<Result_>
+        {
+            void visit(struct NotReallyAType) const;
+        };
+
+        template <typename Result_, typename Func_, typename... Rest_>
+        struct StoredLambdaVisitor<Result_, Func_, Rest_...> :
+            StoredLambdaVisitor<Result_, Rest_...>
+        {
+            Func_ func;
+
+            StoredLambdaVisitor(const Func_ & f, const Rest_ & ... rest)
+                : StoredLambdaVisitor<Result_, Rest_...>(rest...),
+                  func(f)
+            {
+            }
+
+            Result_ visit(typename LambdaParameterTypes<Func_>::FirstParameterType & v) const
+            {
+                return func(v);
+            }
+
+            using StoredLambdaVisitor<Result_, Rest_...>::visit;
+        };
+
+        // Finds the held value's type and the lambda to call for it, without
+        // calling it: the call happens through a plain function pointer once
+        // accept() has returned, so nothing needs to be allocated or bound.
+        template <typename Visitor_, typename Matcher_, typename Result_, typename... Types_>
+        struct MatcherVisit;
+
+        template <typename Visitor_, typename Matcher_, typename Result_>
+        struct MatcherVisit<Visitor_, Matcher_, Result_> :
+            Visitor_
+        {
+            Result_ (* call)(const Matcher_ &, void *) = nullptr;
+            void * value = nullptr;
+        };
+
+        template <typename Visitor_, typename Matcher_, typename Result_, typename Type_, typename... Rest_>
+        struct MatcherVisit<Visitor_, Matcher_, Result_, Type_, Rest_...> :
+            MatcherVisit<Visitor_, Matcher_, Result_, Rest_...>
+        {
+            static Result_ call_with(const Matcher_ & matcher, void * value)
+            {
+                return matcher.visit(*static_cast<Type_ *>(value));
+            }
+
+            virtual void visit(Type_ & t)
+            {
+                this->call = &call_with;
+                this->value = const_cast<typename std::remove_const<Type_>::type *>(&t);
+            }
+        };
+
+        template <typename Matcher_, typename Result_, typename OneOf_>
+        struct MatcherVisitTypeFinder;
+
+        template <typename Matcher_, typename Result_, typename Policy_, typename... Types_>
+        struct MatcherVisitTypeFinder<Matcher_, Result_, const OneOfImpl<Policy_, Types_...> &>
+        {
+            typedef MatcherVisit<OneOfVisitor<const Types_...>, Matcher_, Result_, const Types_...> Type;
+        };
+
+        template <typename Matcher_, typename Result_, typename Policy_, typename... Types_>
+        struct MatcherVisitTypeFinder<Matcher_, Result_, OneOfImpl<Policy_, Types_...> &>
+        {
+            typedef MatcherVisit<OneOfVisitor<Types_...>, Matcher_, Result_, Types_...> Type;
+        };
+
+        template <typename Result_, typename... Funcs_>
+        class Matcher :
+            private StoredLambdaVisitor<Result_, Funcs_...>
+        {
+            private:
+                typedef StoredLambdaVisitor<Result_, Funcs_...> Visitor;
+
+                template <typename, typename, typename, typename...> friend struct MatcherVisit;
+                template <typename, typename, typename...> friend class ProfiledMatcher;
+
+            public:
+                Matcher(const Funcs_ & ... funcs)
+                    : Visitor(funcs...)
+                {
+                }
+
+                template <typename OneOf_>
+                Result_ operator() (OneOf_ && one_of) const
+                {
+                    return apply(one_of);
+                }
+
+            private:
+                template <typename OneOf_>
+                Result_ apply(OneOf_ & one_of) const
+                {
+                    const Visitor & visitor = *this;
+
+                    if (one_of.empty())
+                        return visit_empty<Result_>(visitor, typename HasEmptyVisit<const Visitor>::Type());
+
+                    typename MatcherVisitTypeFinder<Matcher, Result_, OneOf_ &>::Type visit;
+                    one_of.value().accept(visit);
+                    return visit.call(*this, visit.value);
+                }
+        };
+
+        // Direct access to the value held by a OneOf, for when its index()
+        // has already said which type it is
+        template <typename OneOf_>
+        struct OneOfHeld;
+
+        template <typename Policy_, typename... Types_>
+        struct OneOfHeld<OneOfImpl<Policy_, Types_...> >
+        {
+            template <typename Type_>
+            static constexpr std::size_t index()
+            {
+                return IndexOfType<Type_, Types_...>::value;
+            }
+
+            template <typename Type_>
+            static Type_ & get(OneOfImpl<Policy_, Types_...> & one_of)
+            {
+                return static_cast<OneOfValue<Type_, Types_...> &>(one_of.value()).value;
+            }
+
+            template <typename Type_>
+            static const Type_ & get(const OneOfImpl<Policy_, Types_...> & one_of)
+            {
+                return static_cast<const OneOfValue<Type_, Types_...> &>(one_of.value()).value;
+            }
+        };
+
+        // A Matcher for one OneOf type that samples which types it sees, and
+        // checks first for the most common one: if the held type is that one,
+        // its lambda is called directly, and everything else goes through the
+        // Matcher. The counts are halved each time the choice is revisited,
+        // so it follows changes in the traffic.
+        template <typename OneOf_, typename Result_, typename... Funcs_>
+        class ProfiledMatcher;
+
+        template <typename Policy_, typename... Types_, typename Result_, typename... Funcs_>
+        class ProfiledMatcher<OneOfImpl<Policy_, Types_...>, Result_, Funcs_...>
+        {
+            private:
+                typedef OneOfImpl<Policy_, Types_...> OneOf;
+
+                // Only one call in sample_interval to each matcher is counted,
+                // and the most common type is chosen again every
+                // rebalance_interval counted calls. The tick is read and
+                // written rather than incremented atomically, so calls from
+                // several threads at once may lose ticks, which only makes
+                // sampling a little less regular.
+                static constexpr unsigned sample_interval = 64;
+                static constexpr std::size_t rebalance_interval = 1024;
+
+                Matcher<Result_, Funcs_...> _matcher;
+                mutable std::atomic<std::size_t> _counts[sizeof...(Types_)];
+                mutable std::atomic<std::size_t> _samples;
+                mutable std::atomic<std::size_t> _likely;
+                mutable std::atomic<unsigned> _tick;
+
+                // Calls the lambda for the type at index, which one_of is
+                // known to hold
+                template <typename OneOfRef_>
+                Result_ visit_held(OneOfRef_ & one_of, std::size_t) const
+                {
+                    return _matcher(one_of);
+                }
+
+                template <typename OneOfRef_, typename Type_, typename... Rest_>
+                Result_ visit_held(OneOfRef_ & one_of, std::size_t index) const
+                {
+                    if (index == IndexOfType<Type_, Types_...>::value)
+                        return static_cast<const StoredLambdaVisitor<Result_, Funcs_...> &>(_matcher).visit(
+                                OneOfHeld<OneOf>::template get<Type_>(one_of));
+
+                    return visit_held<OneOfRef_, Rest_...>(one_of, index);
+                }
+
+                SHRINK_NOINLINE void sample(std::size_t index) const
+                {
+                    if (index >= sizeof...(Types_))
+                        return;
+
+                    _counts[index].fetch_add(1, std::memory_order_relaxed);
+                    if (_samples.fetch_add(1, std::memory_order_relaxed) % rebalance_interval == rebalance_interval - 1)
+                        rebalance();
+                }
+
+                void rebalance() const
+                {
+                    std::size_t likely = 0, most = 0;
+                    for (std::size_t i = 0; i < sizeof...(Types_); ++i)
+                    {
+                        std::size_t count = _counts[i].load(std::memory_order_relaxed);
+                        if (count > most)
+                        {
+                            most = count;
+                            likely = i;
+                        }
+                        _counts[i].store(count / 2, std::memory_order_relaxed);
+                    }
+                    _likely.store(likely, std::memory_order_relaxed);
+                }
+
+                template <typename OneOfRef_>
+                Result_ apply(OneOfRef_ & one_of) const
+                {
+                    std::size_t index = one_of.index();
+
+                    // Counting is kept out of line, away from the common path
+                    unsigned tick = _tick.load(std::memory_order_relaxed) + 1;
+                    _tick.store(tick, std::memory_order_relaxed);
+                    if (SHRINK_UNLIKELY(tick % sample_interval == 0))
+                        sample(index);
+
+                    if (SHRINK_LIKELY(index == _likely.load(std::memory_order_relaxed)))
+                        return visit_held<OneOfRef_, Types_...>(one_of, index);
+
+                    return _matcher(one_of);
+                }
+
+            public:
+                ProfiledMatcher(const Funcs_ & ... funcs)
+                    : _matcher(funcs...), _samples(0), _likely(0), _tick(0)
+                {
+                    for (auto & count : _counts)
+                        count.store(0, std::memory_order_relaxed);
+                }
+
+                ProfiledMatcher(const ProfiledMatcher & other)
+                    : _matcher(other._matcher), _samples(other._samples.load()), _likely(other._likely.load()), _tick(0)
+                {
+                    for (std::size_t i = 0; i < sizeof...(Types_); ++i)
+                        _counts[i].store(other._counts[i].load(), std::memory_order_relaxed);
+                }
+
+                Result_ operator() (OneOf & one_of) const
+                {
+                    return apply(one_of);
+                }
+
+                Result_ operator() (const OneOf & one_of) const
+                {
+                    return apply(one_of);
+                }
+
+                // The index of the type currently checked first
+                std::size_t likely_index() const
+                {
+                    return _likely.load(std::memory_order_relaxed);
+                }
+        };
+
+        template <typename Policy_, typename... Types_, typename Result_, typename... Funcs_>
+        constexpr unsigned ProfiledMatcher<OneOfImpl<Policy_, Types_...>, Result_, Funcs_...>::sample_interval;
+
+        template <typename Policy_, typename... Types_, typename Result_, typename... Funcs_>
+        constexpr std::size_t ProfiledMatcher<OneOfImpl<Policy_, Types_...>, Result_, Funcs_...>::rebalance_interval;
+
         // Default storage policy for OneOf is defined here
         template <typename... Types_> struct OneOfTypeFinder
         {
@@ -352,6 +1135,49 @@ namespace shrink
                 oneof_internal::LambdaVisitor<typename oneof_internal::LambdaParameterTypes<FirstFunc_>::ReturnType, FirstFunc_, Rest_...>(first_func, rest...));
     }
 
+    // A stored equivalent of when(): matcher(lambdas...) can be kept and
+    // applied to any number of OneOfs whose types the lambdas cover, without
+    // rebuilding a visitor each time. It holds copies of the lambdas and
+    // only calls them through const, so it can be shared between threads.
+    template <typename FirstFunc_, typename... Rest_>
+    oneof_internal::Matcher<
+        typename oneof_internal::LambdaParameterTypes<typename std::decay<FirstFunc_>::type>::ReturnType,
+        typename std::decay<FirstFunc_>::type,
+        typename std::decay<Rest_>::type...>
+    matcher(FirstFunc_ && first_func, Rest_ && ... rest)
+    {
+        return { first_func, rest... };
+    }
+
+    // when() for a OneOf that almost always holds a Likely_: that case is
+    // checked first, with a branch hinted as taken, and calls its lambda
+    // directly. Anything else falls back to when().
+    template <typename Likely_, typename Val_, typename FirstFunc_, typename... Rest_>
+    typename oneof_internal::LambdaParameterTypes<FirstFunc_>::ReturnType
+    when_likely(Val_ && val, FirstFunc_ && first_func, Rest_ && ... rest)
+    {
+        typedef typename std::remove_cv<typename std::remove_reference<Val_>::type>::type OneOf_;
+
+        if (SHRINK_LIKELY(val.index() == oneof_internal::OneOfHeld<OneOf_>::template index<Likely_>()))
+            return oneof_internal::LambdaVisitor<typename oneof_internal::LambdaParameterTypes<FirstFunc_>::ReturnType, FirstFunc_, Rest_...>(first_func, rest...).visit(
+                    oneof_internal::OneOfHeld<OneOf_>::template get<Likely_>(val));
+
+        return when(val, std::forward<FirstFunc_>(first_func), std::forward<Rest_>(rest)...);
+    }
+
+    // A matcher for OneOf_ that learns which type is most common at runtime
+    // and checks for it first, as when_likely() would
+    template <typename OneOf_, typename FirstFunc_, typename... Rest_>
+    oneof_internal::ProfiledMatcher<
+        OneOf_,
+        typename oneof_internal::LambdaParameterTypes<typename std::decay<FirstFunc_>::type>::ReturnType,
+        typename std::decay<FirstFunc_>::type,
+        typename std::decay<Rest_>::type...>
+    profiled_matcher(FirstFunc_ && first_func, Rest_ && ... rest)
+    {
+        return { first_func, rest... };
+    }
+
     template <typename Result_, typename Policy_, typename... Types_>
     const Result_ & extract(const oneof_internal::OneOfImpl<Policy_, Types_...> & oneof)
     {
@@ -364,6 +1190,14 @@ namespace shrink
         return when(oneof, [](Result_ & r) -> Result_ & { return r; });
     }
 
+    // Narrowing conversion: moves or copies from into to if it holds one of
+    // to's types, returning false otherwise.
+    template <typename From_, typename Policy_, typename... Types_>
+    bool try_convert(From_ && from, oneof_internal::OneOfImpl<Policy_, Types_...> & to)
+    {
+        return to.try_assign(std::forward<From_>(from));
+    }
+
 }
 
 #endif
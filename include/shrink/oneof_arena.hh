@@ -0,0 +1,323 @@
+#ifndef libshrink__oneof_arena_hh
+#define libshrink__oneof_arena_hh
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <shrink/storage_policy.hh>
+#include <shrink/oneof.hh>
+
+// OneOf<arena_storage, Types...> allocates its nodes from the oneof_arena
+// made current by a oneof_arena::scope, rather than from the heap. The arena
+// hands out nodes in allocation order from large blocks, and frees them all
+// at once when it's reset or destroyed, so a tree of OneOfs built inside a
+// scope is laid out contiguously and costs no frees to throw away.
+//
+// A type can hold a OneOf of itself (directly, or through another type), as
+// with:
+//
+//     struct BinaryOp;
+//     typedef OneOf<storage_policy::arena_storage, Literal, BinaryOp> Expr;
+//     struct BinaryOp { char op; Expr lhs, rhs; };
+//
+// Arena OneOfs don't own their nodes, so copying one shares the node as
+// with shared_storage, and assigning to one always takes a new node from the
+// current arena. No arena OneOf may be used after its arena is reset.
+
+namespace shrink
+{
+    namespace exceptions
+    {
+        struct NoOneOfArenaException : std::runtime_error
+        {
+            NoOneOfArenaException()
+                : std::runtime_error("Attempted to make an arena OneOf with no oneof_arena in scope")
+            { }
+        };
+    }
+
+    namespace oneof_internal
+    {
+        // Whether a node needs its destructor run before the arena frees it.
+        // Value nodes always have a virtual destructor, but it only does
+        // anything if the held type has a destructor of its own.
+        template <typename Node_>
+        struct ArenaNodeNeedsCleanup :
+            std::integral_constant<bool, ! std::is_trivially_destructible<Node_>::value>
+        {
+        };
+
+        template <typename Type_, typename... Types_>
+        struct ArenaNodeNeedsCleanup<OneOfValue<Type_, Types_...> > :
+            std::integral_constant<bool, ! std::is_trivially_destructible<Type_>::value>
+        {
+        };
+    }
+
+    class oneof_arena
+    {
+        private:
+            struct Block
+            {
+                Block * next;
+                std::size_t size;
+            };
+
+            struct Cleanup
+            {
+                void (* destroy)(void *);
+                void * object;
+            };
+
+            // Cleanup records are kept apart from the nodes, so that nodes
+            // needing a destructor are as tightly packed as those that don't
+            struct CleanupBlock
+            {
+                static constexpr std::size_t capacity = 256;
+
+                CleanupBlock * next;
+                std::size_t used;
+                Cleanup cleanups[capacity];
+            };
+
+            static constexpr std::size_t alignment = alignof(std::max_align_t);
+            static constexpr std::size_t header = (sizeof(Block) + alignment - 1) / alignment * alignment;
+
+            std::size_t _block_size;
+            Block * _blocks;
+            char * _next;
+            char * _end;
+            CleanupBlock * _cleanups;
+
+            static oneof_arena * & current_arena()
+            {
+                static thread_local oneof_arena * arena = nullptr;
+                return arena;
+            }
+
+            static char * data(Block * block)
+            {
+                return reinterpret_cast<char *>(block) + header;
+            }
+
+            template <typename Type_>
+            static void destroy(void * object)
+            {
+                static_cast<Type_ *>(object)->~Type_();
+            }
+
+            Block * new_block(std::size_t size)
+            {
+                Block * block = static_cast<Block *>(::operator new(header + size));
+                block->size = size;
+                return block;
+            }
+
+            void * allocate_slow(std::size_t size, std::size_t align)
+            {
+                // Anything that would waste much of a block gets a block of
+                // its own, behind the current one so that it stays current
+                if (size + align > _block_size / 4)
+                {
+                    Block * block = new_block(size);
+                    if (_blocks)
+                    {
+                        block->next = _blocks->next;
+                        _blocks->next = block;
+                    }
+                    else
+                    {
+                        block->next = nullptr;
+                        _blocks = block;
+                    }
+                    return data(block);
+                }
+
+                Block * block = new_block(_block_size);
+                block->next = _blocks;
+                _blocks = block;
+                _next = data(block);
+                _end = _next + _block_size;
+                return allocate(size, align);
+            }
+
+            // Makes sure there's room for one more cleanup record, so that
+            // recording one can't fail once its object is made
+            void reserve_cleanup()
+            {
+                if (_cleanups && _cleanups->used < CleanupBlock::capacity)
+                    return;
+
+                CleanupBlock * block = new CleanupBlock;
+                block->next = _cleanups;
+                block->used = 0;
+                _cleanups = block;
+            }
+
+        public:
+            static constexpr std::size_t default_block_size = 64 * 1024;
+
+            explicit oneof_arena(std::size_t block_size = default_block_size) :
+                _block_size(block_size),
+                _blocks(nullptr),
+                _next(nullptr),
+                _end(nullptr),
+                _cleanups(nullptr)
+            {
+            }
+
+            oneof_arena(const oneof_arena &) = delete;
+            oneof_arena & operator= (const oneof_arena &) = delete;
+
+            ~oneof_arena()
+            {
+                reset();
+                ::operator delete(_blocks);
+                delete _cleanups;
+            }
+
+            // The arena that arena OneOfs on this thread allocate from, or
+            // null outside of any scope
+            static oneof_arena * current()
+            {
+                return current_arena();
+            }
+
+            // Makes an arena current on this thread for the scope's lifetime
+            class scope
+            {
+                private:
+                    oneof_arena * _previous;
+
+                public:
+                    explicit scope(oneof_arena & arena) :
+                        _previous(current_arena())
+                    {
+                        current_arena() = &arena;
+                    }
+
+                    scope(const scope &) = delete;
+                    scope & operator= (const scope &) = delete;
+
+                    ~scope()
+                    {
+                        current_arena() = _previous;
+                    }
+            };
+
+            void * allocate(std::size_t size, std::size_t align)
+            {
+                std::size_t pad = (align - reinterpret_cast<std::uintptr_t>(_next) % align) % align;
+                if (_next && pad + size <= static_cast<std::size_t>(_end - _next))
+                {
+                    char * result = _next + pad;
+                    _next = result + size;
+                    return result;
+                }
+
+                return allocate_slow(size, align);
+            }
+
+            template <typename Type_, typename... Args_>
+            Type_ * make(Args_ && ... args)
+            {
+                static_assert(alignof(Type_) <= alignment, "Over-aligned types can't be allocated from an arena");
+
+                bool needs_cleanup = oneof_internal::ArenaNodeNeedsCleanup<Type_>::value;
+                if (needs_cleanup)
+                    reserve_cleanup();
+
+                Type_ * result = new (allocate(sizeof(Type_), alignof(Type_))) Type_(std::forward<Args_>(args)...);
+
+                if (needs_cleanup)
+                    _cleanups->cleanups[_cleanups->used++] = Cleanup{ &destroy<Type_>, result };
+
+                return result;
+            }
+
+            // Destroys everything made from the arena, newest first, and frees
+            // all but one block for reuse
+            void reset()
+            {
+                for (CleanupBlock * block = _cleanups; block; block = block->next)
+                    while (block->used)
+                    {
+                        Cleanup & cleanup = block->cleanups[--block->used];
+                        cleanup.destroy(cleanup.object);
+                    }
+
+                if (_cleanups)
+                {
+                    for (CleanupBlock * block = _cleanups->next, * next; block; block = next)
+                    {
+                        next = block->next;
+                        delete block;
+                    }
+                    _cleanups->next = nullptr;
+                }
+
+                if (! _blocks)
+                    return;
+
+                for (Block * block = _blocks->next, * next; block; block = next)
+                {
+                    next = block->next;
+                    ::operator delete(block);
+                }
+
+                _blocks->next = nullptr;
+                _next = data(_blocks);
+                _end = _next + _blocks->size;
+            }
+    };
+
+    namespace oneof_internal
+    {
+        template <typename Value_>
+        struct OneOfStorage<shrink::storage_policy::arena_storage, Value_>
+        {
+            Value_ * _storage;
+
+            Value_ & operator*() { return *_storage; }
+            const Value_ & operator*() const { return *_storage; }
+
+            OneOfStorage(Value_ * v) : _storage(v) { }
+            OneOfStorage(OneOfStorage && other) noexcept : _storage(other._storage) { other._storage = nullptr; }
+            OneOfStorage(const OneOfStorage & other) : _storage(other._storage) { }
+            OneOfStorage & operator= (const OneOfStorage & other) { _storage = other._storage; return *this; }
+            OneOfStorage & operator= (OneOfStorage && other) noexcept { _storage = other._storage; other._storage = nullptr; return *this; }
+
+            void reset(Value_* v) { _storage = v; }
+            bool empty() const { return ! _storage; }
+
+            // Nodes belong to the arena, so can't be rebuilt in place as
+            // another OneOf's node or handed to one that would delete them
+            static constexpr bool owns_nodes = false;
+
+            template <typename Node_, typename... Args_>
+            static Node_ * make(Args_ && ... args)
+            {
+                oneof_arena * arena = oneof_arena::current();
+                if (! arena)
+                    throw exceptions::NoOneOfArenaException();
+                return arena->make<Node_>(std::forward<Args_>(args)...);
+            }
+
+            // Copying a OneOf shares its node, and any node might be shared
+            static constexpr bool copies_value = false;
+            Value_ * release_unshared() { return nullptr; }
+            bool unshared() const { return false; }
+        };
+
+        template <typename... Types_> struct OneOfTypeFinder<shrink::storage_policy::arena_storage, Types_...>
+        {
+            typedef OneOfImpl<shrink::storage_policy::arena_storage, Types_...> Type;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef libshrink__oneof_range_hh
+#define libshrink__oneof_range_hh
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  define SHRINK_ONEOF_RANGE_X86 1
+#  include <immintrin.h>
+#endif
+
+#include <shrink/oneof.hh>
+
+namespace shrink
+{
+    namespace oneof_internal
+    {
+        template <typename OneOf_>
+        struct OneOfRangeTraits;
+
+        template <typename Policy_, typename... Types_>
+        struct OneOfRangeTraits<OneOfImpl<Policy_, Types_...> >
+        {
+            static_assert(sizeof...(Types_) < 255, "Tags are 8 bits, with one value reserved for empty");
+
+            // One bucket per type, and one more for empty OneOfs
+            static constexpr std::size_t buckets = sizeof...(Types_) + 1;
+        };
+
+        template <typename Range_>
+        struct RangeValueType
+        {
+            typedef typename std::decay<decltype(*std::begin(std::declval<Range_ &>()))>::type Type;
+        };
+
+        inline void count_tags_scalar(const std::uint8_t * tags, std::size_t n, std::size_t * counts)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                ++counts[tags[i]];
+        }
+
+#ifdef SHRINK_ONEOF_RANGE_X86
+        // Compares a block of tags against each bucket in turn, accumulating
+        // matches in 8-bit lanes. A block is at most 255 vectors so the lanes
+        // can't overflow before being summed with psadbw.
+        inline void count_tags_sse2(const std::uint8_t * tags, std::size_t n, std::size_t * counts, std::size_t buckets)
+        {
+            const std::size_t width = sizeof(__m128i), block = 255 * width;
+            const __m128i zero = _mm_setzero_si128();
+            std::size_t i = 0;
+
+            for ( ; i + width <= n; )
+            {
+                std::size_t end = i + std::min(block, (n - i) / width * width);
+
+                for (std::size_t b = 0; b < buckets; ++b)
+                {
+                    const __m128i want = _mm_set1_epi8(static_cast<char>(b));
+                    __m128i matches = zero;
+
+                    for (std::size_t j = i; j < end; j += width)
+                    {
+                        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tags + j));
+                        matches = _mm_sub_epi8(matches, _mm_cmpeq_epi8(v, want));
+                    }
+
+                    __m128i sums = _mm_sad_epu8(matches, zero);
+                    counts[b] += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+                }
+
+                i = end;
+            }
+
+            count_tags_scalar(tags + i, n - i, counts);
+        }
+
+        __attribute__((target("avx2")))
+        inline void count_tags_avx2(const std::uint8_t * tags, std::size_t n, std::size_t * counts, std::size_t buckets)
+        {
+            const std::size_t width = sizeof(__m256i), block = 255 * width;
+            const __m256i zero = _mm256_setzero_si256();
+            std::size_t i = 0;
+
+            for ( ; i + width <= n; )
+            {
+                std::size_t end = i + std::min(block, (n - i) / width * width);
+
+                for (std::size_t b = 0; b < buckets; ++b)
+                {
+                    const __m256i want = _mm256_set1_epi8(static_cast<char>(b));
+                    __m256i matches = zero;
+
+                    for (std::size_t j = i; j < end; j += width)
+                    {
+                        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tags + j));
+                        matches = _mm256_sub_epi8(matches, _mm256_cmpeq_epi8(v, want));
+                    }
+
+                    __m256i sums = _mm256_sad_epu8(matches, zero);
+                    counts[b] += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1)
+                        + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+                }
+
+                i = end;
+            }
+
+            count_tags_scalar(tags + i, n - i, counts);
+        }
+
+        typedef void (* CountTagsFunction)(const std::uint8_t *, std::size_t, std::size_t *, std::size_t);
+
+        inline CountTagsFunction find_count_tags()
+        {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? &count_tags_avx2 : &count_tags_sse2;
+        }
+#endif
+
+        // Each vector pass only checks for one bucket, so past this many
+        // buckets one scalar pass over the tags is cheaper.
+        constexpr std::size_t max_vector_count_buckets = 16;
+    }
+
+    // Counts how many of tags[0..n) have each value below buckets, adding
+    // the results to counts[0..buckets). Every tag must be below buckets.
+    inline void count_tags(const std::uint8_t * tags, std::size_t n, std::size_t * counts, std::size_t buckets)
+    {
+#ifdef SHRINK_ONEOF_RANGE_X86
+        if (buckets <= oneof_internal::max_vector_count_buckets)
+        {
+            static const oneof_internal::CountTagsFunction count = oneof_internal::find_count_tags();
+            count(tags, n, counts, buckets);
+            return;
+        }
+#endif
+        oneof_internal::count_tags_scalar(tags, n, counts);
+    }
+
+    // Writes the index() of each OneOf in range to out as an 8-bit tag.
+    // Empty OneOfs get the tag one past their last type.
+    template <typename Range_, typename Out_>
+    Out_ tags_of(const Range_ & range, Out_ out)
+    {
+        static_assert(oneof_internal::RangeValueType<const Range_>::Type::size < 255,
+                "Tags are 8 bits, with one value reserved for empty");
+
+        for (const auto & one_of : range)
+            *out++ = static_cast<std::uint8_t>(one_of.index());
+        return out;
+    }
+
+    // The number of OneOfs in range holding each type, in the order of the
+    // OneOf's types, followed by the number that are empty
+    template <typename Range_>
+    std::array<std::size_t, oneof_internal::OneOfRangeTraits<typename oneof_internal::RangeValueType<const Range_>::Type>::buckets>
+    count_by_type(const Range_ & range)
+    {
+        typedef oneof_internal::OneOfRangeTraits<typename oneof_internal::RangeValueType<const Range_>::Type> Traits;
+
+        std::vector<std::uint8_t> tags;
+        tags.reserve(std::distance(std::begin(range), std::end(range)));
+        tags_of(range, std::back_inserter(tags));
+
+        std::array<std::size_t, Traits::buckets> counts{};
+        count_tags(tags.data(), tags.size(), counts.data(), Traits::buckets);
+        return counts;
+    }
+
+    // Stably reorders range so that OneOfs holding the same type are
+    // together, in the order of the OneOf's types with empty ones last, and
+    // returns the size of each group as count_by_type does. Visiting a range
+    // sorted like this keeps the dispatch for each element predictable.
+    template <typename Range_>
+    std::array<std::size_t, oneof_internal::OneOfRangeTraits<typename oneof_internal::RangeValueType<Range_>::Type>::buckets>
+    partition_by_type(Range_ & range)
+    {
+        typedef typename oneof_internal::RangeValueType<Range_>::Type OneOf_;
+        typedef oneof_internal::OneOfRangeTraits<OneOf_> Traits;
+
+        static_assert(std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<
+                    decltype(std::begin(std::declval<Range_ &>()))>::iterator_category>::value,
+                "partition_by_type needs a range with random access iterators");
+
+        std::vector<std::uint8_t> tags;
+        tags.reserve(std::distance(std::begin(range), std::end(range)));
+        tags_of(range, std::back_inserter(tags));
+
+        std::array<std::size_t, Traits::buckets> counts{};
+        count_tags(tags.data(), tags.size(), counts.data(), Traits::buckets);
+
+        std::array<std::size_t, Traits::buckets> offsets;
+        std::size_t offset = 0;
+        for (std::size_t b = 0; b < Traits::buckets; ++b)
+        {
+            offsets[b] = offset;
+            offset += counts[b];
+        }
+
+        std::vector<OneOf_> moved(std::make_move_iterator(std::begin(range)), std::make_move_iterator(std::end(range)));
+        auto first = std::begin(range);
+        for (std::size_t i = 0; i < moved.size(); ++i)
+            first[offsets[tags[i]]++] = std::move(moved[i]);
+
+        return counts;
+    }
+}
+
+#endif
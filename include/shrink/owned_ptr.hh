@@ -4,6 +4,8 @@
 
 #include <stdexcept>
 #include <atomic>
+#include <thread>
+#include <type_traits>
 
 namespace shrink
 {
@@ -43,22 +45,182 @@ namespace shrink
                 : std::runtime_error("Attempted to dereference a handle_ptr to an invalid owned_ptr")
             { }
         };
+
+        struct EmptyHandleGroupException : std::runtime_error
+        {
+            EmptyHandleGroupException()
+                : std::runtime_error("Attempted to take a handle_ptr from a handle_group with no references left")
+            { }
+        };
+
+        struct ForeignHandlePtrException : std::runtime_error
+        {
+            ForeignHandlePtrException()
+                : std::runtime_error("Attempted to return a handle_ptr to a handle_group it didn't come from")
+            { }
+        };
     }
 
     template <typename T_>
     class handle_ptr;
 
     template <typename T_>
-    class owned_ptr
+    class handle_group;
+
+    template <typename T_>
+    class weak_handle_ptr;
+
+    namespace owned_ptr_internal
+    {
+        class OwnedPtrBase;
+
+        enum WeakState : unsigned
+        {
+            dead,
+            alive,
+            releasing
+        };
+
+        // Shared between an owned object and its weak handles, and kept alive
+        // by them after the object is released so they can tell it's gone.
+        // The owner holds one reference until it releases the object.
+        //
+        // A weak handle only follows owner while it's counted in locking and
+        // has seen the state alive. The owner sets the state to releasing and
+        // waits for locking to drain before it checks its references, so it
+        // can't go away under a lock(), and either sees the reference the
+        // lock() took or the lock() sees that it's no longer alive.
+        struct WeakControl
+        {
+            std::atomic<const OwnedPtrBase *> owner;
+            std::atomic_uint references;
+            std::atomic_uint state;
+            std::atomic_uint locking;
+
+            WeakControl(const OwnedPtrBase * o)
+                : owner(o), references(1), state(alive), locking(0)
+            { }
+
+            void acquire() { ++references; }
+
+            void release()
+            {
+                if (--references == 0)
+                    delete this;
+            }
+        };
+
+        // The part of an owned_ptr that its handles use, independent of the
+        // owned type, so that a handle can point at a member of the object
+        // while counting against the whole object's owner.
+        class OwnedPtrBase
+        {
+            public:
+                bool good() const { return _obj != nullptr; }
+
+            protected:
+                void * _obj;
+                mutable std::atomic_uint _references;
+                mutable std::atomic<WeakControl *> _weak;
+
+                OwnedPtrBase(void * obj)
+                    : _obj(obj), _references(0), _weak(nullptr)
+                { }
+
+                // Only allocated once something asks for a weak handle
+                WeakControl * weak_control() const
+                {
+                    WeakControl * control = _weak.load();
+                    if (control)
+                        return control;
+
+                    WeakControl * created = new WeakControl(this);
+                    if (_weak.compare_exchange_strong(control, created))
+                        return created;
+
+                    delete created;
+                    return control;
+                }
+
+                // Stops weak handles taking new references, once any lock()
+                // already in progress has taken its reference or backed off
+                WeakControl * hold_weak()
+                {
+                    WeakControl * control = _weak.load();
+                    if (control)
+                    {
+                        control->state = releasing;
+                        while (control->locking != 0)
+                            std::this_thread::yield();
+                    }
+                    return control;
+                }
+
+                // Lets weak handles lock the object again after a release
+                // that failed
+                static void unhold_weak(WeakControl * control)
+                {
+                    if (control)
+                        control->state = alive;
+                }
+
+                // Tells weak handles that the object is going away
+                void detach_weak()
+                {
+                    if (WeakControl * control = _weak.exchange(nullptr))
+                    {
+                        control->owner = nullptr;
+                        control->state = dead;
+                        control->release();
+                    }
+                }
+
+                void take_weak(OwnedPtrBase & rhs)
+                {
+                    WeakControl * control = rhs._weak.exchange(nullptr);
+                    if (control)
+                        control->owner = this;
+                    _weak = control;
+                }
+
+                void check_deref() const
+                {
+                    if (!good())
+                        throw exceptions::InvalidOwnedPtrException();
+                }
+
+                template <typename T_>
+                static void * erase(T_ * obj)
+                {
+                    return const_cast<typename std::remove_cv<T_>::type *>(obj);
+                }
+
+                template <typename U_>
+                friend class shrink::handle_ptr;
+
+                template <typename U_>
+                friend class shrink::handle_group;
+
+                template <typename U_>
+                friend class shrink::weak_handle_ptr;
+        };
+    }
+
+    template <typename T_>
+    class owned_ptr : public owned_ptr_internal::OwnedPtrBase
     {
         public:
             owned_ptr(T_ * obj)
-                : _obj(obj), _references(0)
+                : OwnedPtrBase(erase(obj))
             { }
 
             owned_ptr(owned_ptr && rhs)
-                : _obj(rhs._obj), _references(rhs._references)
-            { }
+                : OwnedPtrBase(rhs._obj)
+            {
+                _references = rhs._references.load();
+                take_weak(rhs);
+                rhs._obj = nullptr;
+            }
 
             void operator=(owned_ptr && rhs)
             {
@@ -67,7 +229,8 @@ namespace shrink
 
                 _obj = rhs._obj;
                 rhs._obj = nullptr;
-                _references = rhs._references;
+                _references = rhs._references.load();
+                take_weak(rhs);
             }
 
             owned_ptr() = delete;
@@ -76,34 +239,28 @@ namespace shrink
 
             ~owned_ptr() { if (good()) release(); }
 
-            T_ * operator->() const { check_deref(); return  _obj; }
-            T_ & operator* () const { check_deref(); return *_obj; }
+            T_ * operator->() const { check_deref(); return  obj(); }
+            T_ & operator* () const { check_deref(); return *obj(); }
 
             void release()
             {
                 if (!good())
                     throw exceptions::ReleasedInvalidOwnedPtrException();
 
+                owned_ptr_internal::WeakControl * control = hold_weak();
                 if (_references > 0)
+                {
+                    unhold_weak(control);
                     throw exceptions::ReferencesStillExistException();
+                }
 
-                delete _obj;
+                detach_weak();
+                delete obj();
                 _obj = nullptr;
             }
 
-            bool good() const { return _obj != nullptr; }
-
         private:
-            T_ * _obj;
-            mutable std::atomic_uint _references;
-
-            friend class handle_ptr<T_>;
-
-            void check_deref() const
-            {
-                if (!good())
-                    throw exceptions::InvalidOwnedPtrException();
-            }
+            T_ * obj() const { return static_cast<T_ *>(_obj); }
     };
 
     template <typename T_>
@@ -111,7 +268,15 @@ namespace shrink
     {
         public:
             handle_ptr(const owned_ptr<T_> & p)
-                : _ptr(&p)
+                : handle_ptr(p, &*p)
+            { }
+
+            // An aliasing handle to obj, which must live inside the object
+            // owned by p. It keeps p from being released, just like a handle
+            // to the whole object.
+            template <typename Owner_>
+            handle_ptr(const owned_ptr<Owner_> & p, T_ * obj)
+                : _ptr(&p), _obj(obj)
             {
                 _ptr->check_deref();
 
@@ -119,13 +284,14 @@ namespace shrink
             }
 
             handle_ptr(handle_ptr && rhs)
-                : _ptr(rhs._ptr)
+                : _ptr(rhs._ptr), _obj(rhs._obj)
             { rhs._ptr = nullptr; }
 
             handle_ptr(const handle_ptr & rhs)
-                : _ptr(rhs._ptr)
+                : _ptr(rhs._ptr), _obj(rhs._obj)
             {
-                ++_ptr->_references;
+                if (_ptr)
+                    ++_ptr->_references;
             }
 
             handle_ptr() = delete;
@@ -136,7 +302,11 @@ namespace shrink
                     release();
 
                 _ptr = rhs._ptr;
-                ++_ptr->_references;
+                _obj = rhs._obj;
+                if (_ptr)
+                    ++_ptr->_references;
+
+                return *this;
             }
 
             ~handle_ptr()
@@ -159,12 +329,21 @@ namespace shrink
                 _ptr = nullptr;
             }
 
-            T_ & operator * () const { check_deref(); return *_ptr->_obj; }
-            T_ * operator-> () const { check_deref(); return  _ptr->_obj; }
+            T_ & operator * () const { check_deref(); return *_obj; }
+            T_ * operator-> () const { check_deref(); return  _obj; }
 
 
         private:
-            const owned_ptr<T_> * _ptr;
+            const owned_ptr_internal::OwnedPtrBase * _ptr;
+            T_ * _obj;
+
+            friend class handle_group<T_>;
+            friend class weak_handle_ptr<T_>;
+
+            // Takes over a reference that the caller has already counted
+            handle_ptr(const owned_ptr_internal::OwnedPtrBase * p, T_ * obj)
+                : _ptr(p), _obj(obj)
+            { }
 
             void check_deref() const
             {
@@ -172,6 +351,197 @@ namespace shrink
                     throw exceptions::InvalidHandlePtrException();
             }
     };
+
+    // Reserves a number of references to an owned_ptr with one atomic
+    // operation on its count, and gives back whatever it still holds with one
+    // more when it's released or destroyed. Neither take() nor put() touches
+    // the owned_ptr's count in between.
+    //
+    // take() is for the thread that owns the group only, and costs no atomic
+    // operation until the handles it holds run out. put() may be called from
+    // any thread, and costs one atomic operation on the group alone. A handle
+    // that is destroyed rather than put back releases its own reference, as
+    // any handle_ptr does, so only handles that are put back are batched.
+    template <typename T_>
+    class handle_group
+    {
+        public:
+            handle_group(const owned_ptr<T_> & p, unsigned count)
+                : handle_group(p, &*p, count)
+            { }
+
+            template <typename Owner_>
+            handle_group(const owned_ptr<Owner_> & p, T_ * obj, unsigned count)
+                : _ptr(&p), _obj(obj), _count(count), _returned(0)
+            {
+                _ptr->check_deref();
+
+                _ptr->_references.fetch_add(count);
+            }
+
+            handle_group(handle_group && rhs)
+                : _ptr(rhs._ptr), _obj(rhs._obj), _count(rhs._count),
+                  _returned(rhs._returned.load(std::memory_order_relaxed))
+            { rhs._ptr = nullptr; }
+
+            handle_group() = delete;
+            handle_group(const handle_group &) = delete;
+            void operator=(const handle_group &) = delete;
+
+            ~handle_group()
+            {
+                if (_ptr)
+                    release();
+            }
+
+            unsigned size() const { return _ptr ? _count + _returned.load(std::memory_order_relaxed) : 0; }
+
+            handle_ptr<T_> take()
+            {
+                if (_ptr && _count == 0)
+                    _count = _returned.exchange(0, std::memory_order_relaxed);
+
+                if (!_ptr || _count == 0)
+                    throw exceptions::EmptyHandleGroupException();
+
+                --_count;
+                return handle_ptr<T_>(_ptr, _obj);
+            }
+
+            void put(handle_ptr<T_> && h)
+            {
+                if (!_ptr || h._ptr != _ptr || h._obj != _obj)
+                    throw exceptions::ForeignHandlePtrException();
+
+                h._ptr = nullptr;
+                _returned.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void release()
+            {
+                if (!_ptr)
+                    throw exceptions::ReleasedInvalidHandlePtrException();
+
+                unsigned count = _count + _returned.exchange(0, std::memory_order_relaxed);
+                _count = 0;
+                if (count > 0)
+                    _ptr->_references.fetch_sub(count);
+                _ptr = nullptr;
+            }
+
+        private:
+            const owned_ptr_internal::OwnedPtrBase * _ptr;
+            T_ * _obj;
+
+            // References held for take(), touched by the owning thread only
+            unsigned _count;
+
+            // References given back by put() from any thread. They only ever
+            // move between the group and its handles, so need no ordering of
+            // their own.
+            std::atomic_uint _returned;
+    };
+
+    // A handle that doesn't count as a reference, so it never stops the
+    // owned_ptr being released. lock() gives a handle_ptr to the object if
+    // it still exists, or an invalid one if it has been released.
+    template <typename T_>
+    class weak_handle_ptr
+    {
+        public:
+            weak_handle_ptr(const owned_ptr<T_> & p)
+                : weak_handle_ptr(p, &*p)
+            { }
+
+            template <typename Owner_>
+            weak_handle_ptr(const owned_ptr<Owner_> & p, T_ * obj)
+                : _control(nullptr), _obj(obj)
+            {
+                p.check_deref();
+
+                _control = p.weak_control();
+                _control->acquire();
+            }
+
+            weak_handle_ptr(const handle_ptr<T_> & h)
+                : _control(nullptr), _obj(h._obj)
+            {
+                h.check_deref();
+
+                _control = h._ptr->weak_control();
+                _control->acquire();
+            }
+
+            weak_handle_ptr(weak_handle_ptr && rhs)
+                : _control(rhs._control), _obj(rhs._obj)
+            { rhs._control = nullptr; }
+
+            weak_handle_ptr(const weak_handle_ptr & rhs)
+                : _control(rhs._control), _obj(rhs._obj)
+            {
+                if (_control)
+                    _control->acquire();
+            }
+
+            weak_handle_ptr() = delete;
+
+            const weak_handle_ptr & operator=(const weak_handle_ptr & rhs)
+            {
+                if (rhs._control)
+                    rhs._control->acquire();
+                if (_control)
+                    _control->release();
+
+                _control = rhs._control;
+                _obj = rhs._obj;
+
+                return *this;
+            }
+
+            ~weak_handle_ptr()
+            {
+                if (_control)
+                    _control->release();
+            }
+
+            bool expired() const
+            {
+                return !_control || _control->state == owned_ptr_internal::dead;
+            }
+
+            handle_ptr<T_> lock() const
+            {
+                if (!_control)
+                    return handle_ptr<T_>(nullptr, _obj);
+
+                for ( ; ; )
+                {
+                    ++_control->locking;
+
+                    unsigned state = _control->state;
+                    if (state == owned_ptr_internal::alive)
+                    {
+                        // The owner can't finish releasing until locking
+                        // drains, so it's safe to follow and count against
+                        const owned_ptr_internal::OwnedPtrBase * owner = _control->owner;
+                        ++owner->_references;
+                        --_control->locking;
+                        return handle_ptr<T_>(owner, _obj);
+                    }
+
+                    --_control->locking;
+
+                    // A release in progress may yet fail, so wait to see
+                    if (state == owned_ptr_internal::dead)
+                        return handle_ptr<T_>(nullptr, _obj);
+                    std::this_thread::yield();
+                }
+            }
+
+        private:
+            owned_ptr_internal::WeakControl * _control;
+            T_ * _obj;
+    };
 }
 
 #endif
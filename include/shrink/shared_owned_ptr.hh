@@ -0,0 +1,610 @@
+#ifndef SHRINK_GUARD_INCLUDE_SHRINK_SHARED_OWNED_PTR_HH
+#define SHRINK_GUARD_INCLUDE_SHRINK_SHARED_OWNED_PTR_HH 1
+
+#include <shrink/owned_ptr.hh>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// owned_ptr and handle_ptr for objects in a memory segment shared between
+// processes. The segment can be mapped at a different address in each
+// process, so everything in it refers to everything else by offset.
+// Handles count their references in per-process leases inside the segment,
+// so that references held by a process that died can be reclaimed.
+
+namespace shrink
+{
+    namespace exceptions
+    {
+        struct NoFreeLeaseException : std::runtime_error
+        {
+            NoFreeLeaseException()
+                : std::runtime_error("Attempted to take a shared_handle_ptr from more processes than an object has leases for")
+            { }
+        };
+
+        struct SharedSegmentFullException : std::runtime_error
+        {
+            SharedSegmentFullException()
+                : std::runtime_error("Attempted to allocate more than a shared_segment has room for")
+            { }
+        };
+
+        struct InvalidSharedSegmentException : std::runtime_error
+        {
+            InvalidSharedSegmentException()
+                : std::runtime_error("Attempted to open something that isn't a shared_segment")
+            { }
+        };
+    }
+
+    namespace shared_owned_ptr_internal
+    {
+        static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+                "Atomics in shared memory must be lock-free to work between processes");
+
+        struct SegmentHeader
+        {
+            static constexpr std::uint64_t expected_magic = 0x6b6e697268737368ull;
+
+            std::uint64_t magic;
+            std::uint64_t size;
+            std::atomic<std::uint64_t> next;
+        };
+
+        // Identifies a process: its pid in the low 32 bits, and the low 32
+        // bits of its start time in the high ones, so that a process which
+        // was given the pid of one that died doesn't match it. Where /proc
+        // doesn't give a start time, just the pid. 0 is no process.
+        typedef std::uint64_t ProcessKey;
+
+        // Marks a lease whose dead holder's references are being reclaimed
+        constexpr ProcessKey recovering_key = ~ProcessKey(0);
+
+        // The process's start time in clock ticks since boot, or 0 if unknown
+        inline std::uint64_t process_start_time(pid_t pid)
+        {
+            char path[32];
+            std::snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+
+            int fd = ::open(path, O_RDONLY);
+            if (fd == -1)
+                return 0;
+
+            char buffer[1024];
+            ssize_t size = ::read(fd, buffer, sizeof(buffer) - 1);
+            ::close(fd);
+            if (size <= 0)
+                return 0;
+            buffer[size] = '\0';
+
+            // The command name in field 2 can hold anything, including spaces
+            // and parentheses, so count from its end. The start time is field 22.
+            const char * p = std::strrchr(buffer, ')');
+            for (int field = 2; p && field < 22; ++field)
+                p = std::strchr(p + 1, ' ');
+
+            return p ? std::strtoull(p + 1, nullptr, 10) : 0;
+        }
+
+        inline ProcessKey process_key(pid_t pid)
+        {
+            return static_cast<std::uint32_t>(pid) | (process_start_time(pid) << 32);
+        }
+
+        // The key for this process, found again after a fork()
+        inline ProcessKey self_key()
+        {
+            static std::atomic<pid_t> cached_pid(0);
+            static std::atomic<ProcessKey> cached_key(0);
+
+            pid_t self = ::getpid();
+            if (cached_pid != self)
+            {
+                cached_key = process_key(self);
+                cached_pid = self;
+            }
+            return cached_key;
+        }
+
+        inline bool process_dead(ProcessKey key)
+        {
+            pid_t pid = static_cast<pid_t>(key & 0xffffffffu);
+            if (::kill(pid, 0) == -1 && errno == ESRCH)
+                return true;
+
+            // The pid is in use, but possibly by a different process
+            std::uint64_t start = key >> 32;
+            return start != 0 && (process_start_time(pid) & 0xffffffffu) != start;
+        }
+
+        // References held by one process. A slot with owner 0 is free.
+        struct Lease
+        {
+            std::atomic<ProcessKey> owner;
+            std::atomic<std::uint32_t> count;
+        };
+
+        enum State : std::uint32_t
+        {
+            dead,
+            alive,
+            releasing
+        };
+
+        struct SharedControl
+        {
+            static constexpr std::size_t leases = 32;
+
+            std::atomic<std::uint32_t> state;
+
+            // The process that made the object, and the only one that can
+            // release it
+            std::atomic<ProcessKey> owner;
+
+            Lease lease[leases];
+
+            SharedControl()
+                : state(alive), owner(self_key())
+            {
+                for (Lease & l : lease)
+                {
+                    l.owner = 0;
+                    l.count = 0;
+                }
+            }
+
+            // Clears the leases of processes that no longer exist, returning
+            // the number of references they were holding. A lease is claimed
+            // for recovery before its count is touched, so two recoveries
+            // can't both clear it, and it can't be reused while it's cleared.
+            std::size_t recover()
+            {
+                std::size_t recovered = 0;
+                for (Lease & l : lease)
+                {
+                    ProcessKey owner = l.owner;
+                    if (owner != 0 && owner != recovering_key && process_dead(owner)
+                            && l.owner.compare_exchange_strong(owner, recovering_key))
+                    {
+                        recovered += l.count.exchange(0);
+                        l.owner = 0;
+                    }
+                }
+                return recovered;
+            }
+
+            Lease & find_lease(ProcessKey self)
+            {
+                for (int attempt = 0; attempt < 2; ++attempt)
+                {
+                    for (Lease & l : lease)
+                        if (l.owner == self)
+                            return l;
+
+                    for (Lease & l : lease)
+                    {
+                        ProcessKey free = 0;
+                        if (l.owner == 0 && l.owner.compare_exchange_strong(free, self))
+                            return l;
+                    }
+
+                    recover();
+                }
+                throw exceptions::NoFreeLeaseException();
+            }
+
+            bool referenced() const
+            {
+                for (const Lease & l : lease)
+                    if (l.count != 0)
+                        return true;
+                return false;
+            }
+        };
+
+        template <typename T_>
+        struct SharedBlock
+        {
+            SharedControl control;
+            T_ value;
+
+            template <typename... Args_>
+            SharedBlock(Args_ && ... args)
+                : value(std::forward<Args_>(args)...)
+            { }
+        };
+    }
+
+    // A pointer that can live in shared memory: it stores the distance to its
+    // target from itself, so it's valid wherever the segment is mapped as
+    // long as both are in the same segment.
+    template <typename T_>
+    class offset_ptr
+    {
+        public:
+            offset_ptr(T_ * p = nullptr) { set(p); }
+            offset_ptr(const offset_ptr & rhs) { set(rhs.get()); }
+            offset_ptr & operator=(const offset_ptr & rhs) { set(rhs.get()); return *this; }
+            offset_ptr & operator=(T_ * p) { set(p); return *this; }
+
+            T_ * get() const
+            {
+                return _offset == 0 ? nullptr :
+                    reinterpret_cast<T_ *>(reinterpret_cast<std::intptr_t>(this) + _offset);
+            }
+
+            T_ & operator* () const { return *get(); }
+            T_ * operator-> () const { return get(); }
+            explicit operator bool() const { return _offset != 0; }
+
+        private:
+            // A pointer to itself isn't representable, so 0 can mean null
+            std::intptr_t _offset;
+
+            void set(T_ * p)
+            {
+                _offset = p ? reinterpret_cast<std::intptr_t>(p) - reinterpret_cast<std::intptr_t>(this) : 0;
+            }
+    };
+
+    // A mapping of a shared memory segment, with a simple allocator in it.
+    // Allocations are never freed individually; their memory goes away with
+    // the segment.
+    class shared_segment
+    {
+        public:
+            // An anonymous segment, shared with processes forked after it's made
+            static shared_segment create(std::size_t size)
+            {
+                void * base = map(-1, size, MAP_SHARED | MAP_ANONYMOUS);
+                return shared_segment(base, size, true);
+            }
+
+            // A named POSIX shared memory segment, which other processes can open()
+            static shared_segment create(const std::string & name, std::size_t size)
+            {
+                if (size < sizeof(Header))
+                    throw exceptions::SharedSegmentFullException();
+
+                int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+                if (fd == -1)
+                    throw std::system_error(errno, std::generic_category(), "shm_open");
+
+                if (::ftruncate(fd, size) == -1)
+                {
+                    int error = errno;
+                    ::close(fd);
+                    ::shm_unlink(name.c_str());
+                    throw std::system_error(error, std::generic_category(), "ftruncate");
+                }
+
+                void * base = map(fd, size, MAP_SHARED);
+                return shared_segment(base, size, true);
+            }
+
+            static shared_segment open(const std::string & name)
+            {
+                int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+                if (fd == -1)
+                    throw std::system_error(errno, std::generic_category(), "shm_open");
+
+                struct stat st;
+                if (::fstat(fd, &st) == -1)
+                {
+                    int error = errno;
+                    ::close(fd);
+                    throw std::system_error(error, std::generic_category(), "fstat");
+                }
+
+                if (static_cast<std::size_t>(st.st_size) < sizeof(Header))
+                {
+                    ::close(fd);
+                    throw exceptions::InvalidSharedSegmentException();
+                }
+
+                void * base = map(fd, st.st_size, MAP_SHARED);
+                shared_segment segment(base, st.st_size, false);
+                if (segment.header().magic != Header::expected_magic)
+                    throw exceptions::InvalidSharedSegmentException();
+                return segment;
+            }
+
+            static void unlink(const std::string & name)
+            {
+                ::shm_unlink(name.c_str());
+            }
+
+            shared_segment(shared_segment && rhs)
+                : _base(rhs._base), _size(rhs._size)
+            { rhs._base = nullptr; }
+
+            shared_segment(const shared_segment &) = delete;
+            void operator=(const shared_segment &) = delete;
+
+            ~shared_segment()
+            {
+                if (_base)
+                    ::munmap(_base, _size);
+            }
+
+            std::size_t allocate(std::size_t size, std::size_t alignment)
+            {
+                std::uint64_t next = header().next, offset;
+                do
+                {
+                    offset = (next + alignment - 1) / alignment * alignment;
+                    if (offset + size > _size)
+                        throw exceptions::SharedSegmentFullException();
+                }
+                while (!header().next.compare_exchange_weak(next, offset + size));
+
+                return offset;
+            }
+
+            void * at(std::size_t offset) const { return static_cast<char *>(_base) + offset; }
+
+            std::size_t offset_of(const void * p) const
+            {
+                return static_cast<const char *>(p) - static_cast<const char *>(_base);
+            }
+
+        private:
+            typedef shared_owned_ptr_internal::SegmentHeader Header;
+
+            void * _base;
+            std::size_t _size;
+
+            shared_segment(void * base, std::size_t size, bool initialise)
+                : _base(base), _size(size)
+            {
+                if (initialise)
+                    new (_base) Header{ Header::expected_magic, size, { sizeof(Header) } };
+            }
+
+            Header & header() const { return *static_cast<Header *>(_base); }
+
+            // Takes ownership of fd, closing it whether or not this succeeds
+            static void * map(int fd, std::size_t size, int flags)
+            {
+                if (size < sizeof(Header))
+                {
+                    if (fd != -1)
+                        ::close(fd);
+                    throw exceptions::SharedSegmentFullException();
+                }
+
+                void * base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+                int error = errno;
+                if (fd != -1)
+                    ::close(fd);
+                if (base == MAP_FAILED)
+                    throw std::system_error(error, std::generic_category(), "mmap");
+                return base;
+            }
+    };
+
+    template <typename T_>
+    class shared_handle_ptr;
+
+    // Owns an object constructed in a shared_segment. Like owned_ptr, it
+    // refuses to release the object while any process holds a handle to it.
+    // Only the process that made it releases the object on destruction.
+    // T_ may be at a different address in each process, so it mustn't hold
+    // absolute pointers; use offset_ptr for links within the segment.
+    template <typename T_>
+    class shared_owned_ptr
+    {
+        public:
+            template <typename... Args_>
+            shared_owned_ptr(shared_segment & segment, Args_ && ... args)
+                : _segment(&segment),
+                  _offset(segment.allocate(sizeof(Block), alignof(Block))),
+                  _pid(::getpid())
+            {
+                new (segment.at(_offset)) Block(std::forward<Args_>(args)...);
+            }
+
+            shared_owned_ptr(shared_owned_ptr && rhs)
+                : _segment(rhs._segment), _offset(rhs._offset), _pid(rhs._pid)
+            { rhs._segment = nullptr; }
+
+            shared_owned_ptr() = delete;
+            shared_owned_ptr(const shared_owned_ptr &) = delete;
+            void operator=(const shared_owned_ptr &) = delete;
+
+            ~shared_owned_ptr() { if (_pid == ::getpid() && good()) release(); }
+
+            T_ * operator->() const { check_deref(); return  &block().value; }
+            T_ & operator* () const { check_deref(); return block().value; }
+
+            // Pass this to other processes to take handles with
+            std::size_t offset() const { return _offset; }
+
+            void release()
+            {
+                using namespace shared_owned_ptr_internal;
+
+                if (!good())
+                    throw exceptions::ReleasedInvalidOwnedPtrException();
+
+                // While the state is releasing, new handles back off, so once
+                // no lease holds a reference none can appear.
+                std::uint32_t expected = alive;
+                if (!block().control.state.compare_exchange_strong(expected, releasing))
+                    throw exceptions::ReleasedInvalidOwnedPtrException();
+
+                if (block().control.referenced())
+                {
+                    block().control.state = alive;
+                    throw exceptions::ReferencesStillExistException();
+                }
+
+                // Dead before the value goes, so that a crash from here on
+                // can't leave the state releasing with the value destroyed
+                block().control.state = dead;
+                block().value.~T_();
+                _segment = nullptr;
+            }
+
+            // Reclaims references held by processes that have died without
+            // releasing them, returning how many there were
+            std::size_t recover()
+            {
+                check_deref();
+                return block().control.recover();
+            }
+
+            bool good() const
+            {
+                return _segment && block().control.state != shared_owned_ptr_internal::dead;
+            }
+
+        private:
+            typedef shared_owned_ptr_internal::SharedBlock<T_> Block;
+
+            shared_segment * _segment;
+            std::size_t _offset;
+            pid_t _pid;
+
+            friend class shared_handle_ptr<T_>;
+
+            Block & block() const { return *static_cast<Block *>(_segment->at(_offset)); }
+
+            void check_deref() const
+            {
+                if (!good())
+                    throw exceptions::InvalidOwnedPtrException();
+            }
+    };
+
+    // A handle to an object owned by a shared_owned_ptr, possibly in another
+    // process, found by the segment it's in and its offset(). A handle only
+    // counts for the process that took it: a copy inherited across fork()
+    // holds no reference and does nothing when destroyed.
+    template <typename T_>
+    class shared_handle_ptr
+    {
+        public:
+            shared_handle_ptr(const shared_segment & segment, std::size_t offset)
+                : _segment(&segment), _offset(offset), _pid(::getpid())
+            {
+                acquire();
+            }
+
+            shared_handle_ptr(const shared_owned_ptr<T_> & p)
+                : shared_handle_ptr(*p._segment, p._offset)
+            { }
+
+            shared_handle_ptr(shared_handle_ptr && rhs)
+                : _segment(rhs._segment), _offset(rhs._offset), _lease(rhs._lease), _pid(rhs._pid)
+            { rhs._segment = nullptr; }
+
+            shared_handle_ptr(const shared_handle_ptr & rhs)
+                : _segment(rhs._segment), _offset(rhs._offset), _pid(::getpid())
+            {
+                if (_segment)
+                    acquire();
+            }
+
+            shared_handle_ptr() = delete;
+            void operator=(const shared_handle_ptr &) = delete;
+
+            ~shared_handle_ptr()
+            {
+                if (_segment && _pid == ::getpid())
+                    release();
+            }
+
+            bool good()
+            {
+                return _segment && block().control.state != shared_owned_ptr_internal::dead;
+            }
+
+            void release()
+            {
+                if (!good())
+                    throw exceptions::ReleasedInvalidHandlePtrException();
+
+                --_lease->count;
+                _segment = nullptr;
+            }
+
+            T_ & operator * () const { check_deref(); return  block().value; }
+            T_ * operator-> () const { check_deref(); return &block().value; }
+
+        private:
+            typedef shared_owned_ptr_internal::SharedBlock<T_> Block;
+
+            const shared_segment * _segment;
+            std::size_t _offset;
+            shared_owned_ptr_internal::Lease * _lease;
+            pid_t _pid;
+
+            Block & block() const { return *static_cast<Block *>(_segment->at(_offset)); }
+
+            void acquire()
+            {
+                shared_owned_ptr_internal::SharedControl & control = block().control;
+
+                _lease = &control.find_lease(shared_owned_ptr_internal::self_key());
+
+                for ( ; ; )
+                {
+                    ++_lease->count;
+
+                    // Pairs with release(): either it sees this reference, or
+                    // this sees that it's no longer alive
+                    std::uint32_t state = control.state;
+                    if (state == shared_owned_ptr_internal::alive)
+                        return;
+
+                    --_lease->count;
+
+                    // A release in progress fails if anything else still holds
+                    // a reference, so only give up once it has succeeded
+                    if (state == shared_owned_ptr_internal::dead)
+                    {
+                        _segment = nullptr;
+                        throw exceptions::InvalidOwnedPtrException();
+                    }
+
+                    // An owner that died partway through a release never got
+                    // as far as destroying the value, so the object is still
+                    // usable; nothing is left that could release it
+                    if (shared_owned_ptr_internal::process_dead(control.owner))
+                        control.state.compare_exchange_strong(state, shared_owned_ptr_internal::alive);
+                    else
+                        std::this_thread::yield();
+                }
+            }
+
+            void check_deref() const
+            {
+                if (!_segment || block().control.state == shared_owned_ptr_internal::dead)
+                    throw exceptions::InvalidHandlePtrException();
+            }
+    };
+}
+
+#endif
+
+
+// vim: set sw=4 sts=4 et :
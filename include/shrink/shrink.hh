@@ -0,0 +1,19 @@
+#ifndef libshrink__shrink_hh
+#define libshrink__shrink_hh
+
+// Everything in libshrink, for use as a precompiled header. That includes
+// <immintrin.h> on x86 with GCC or Clang, for oneof_range.hh, and the POSIX
+// headers behind shared_owned_ptr.hh where they exist; include the headers
+// needed individually to avoid either.
+
+#include <shrink/storage_policy.hh>
+#include <shrink/oneof.hh>
+#include <shrink/oneof_range.hh>
+#include <shrink/oneof_arena.hh>
+#include <shrink/owned_ptr.hh>
+#if defined(__unix__) || defined(__APPLE__)
+#  include <shrink/shared_owned_ptr.hh>
+#endif
+#include <shrink/instantiate.hh>
+
+#endif
@@ -8,6 +8,7 @@ namespace shrink
         struct shared_storage;
         struct unique_storage;
         struct clone_storage;
+        struct arena_storage;
     }
 }
 
@@ -0,0 +1,26 @@
+LIBRARIES = libshrink
+
+CPPFLAGS := -I$(SUBDIR)/../include
+
+# Captured now: recipes are expanded when they run, by which time later
+# build.mk files have set CPPFLAGS and SUBDIR for themselves
+SHRINK_PCH_HEADER := $(SUBDIR)/../include/shrink/shrink.hh
+SHRINK_PCH_CPPFLAGS := $(CPPFLAGS)
+
+ifneq ($(SHRINK_INSTANTIATIONS),)
+CPPFLAGS += -DSHRINK_INSTANTIATIONS='"$(abspath $(SHRINK_INSTANTIATIONS))"'
+endif
+
+libshrink_SOURCES = shrink.cc
+
+# Precompiled shrink/shrink.hh. Put -I$(SHRINK_PCH_DIR) ahead of the include
+# directory and include <shrink/shrink.hh> first to use it.
+SHRINK_PCH_DIR := $(GENERATED_SOURCE_DIR)/pch
+SHRINK_PCH := $(SHRINK_PCH_DIR)/shrink/shrink.hh.gch
+
+$(eval $(call add-dir,$(SHRINK_PCH_DIR)/shrink))
+
+$(SHRINK_PCH): $(SHRINK_PCH_HEADER) $(wildcard $(SUBDIR)/../include/shrink/*.hh) | $(SHRINK_PCH_DIR)/shrink
+	$(CXX) $(CXXFLAGS) $(SHRINK_PCH_CPPFLAGS) -x c++-header $< -o $@
+
+all: $(SHRINK_PCH)
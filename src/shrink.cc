@@ -0,0 +1,16 @@
+#include <shrink/shrink.hh>
+
+// libshrink compiles a project's common OneOf instantiations once. Build it
+// with SHRINK_INSTANTIATIONS set to a header that includes the types
+// involved and lists each OneOf as
+//
+//     SHRINK_ONEOF(int, std::string)
+//
+// and include the same header everywhere else with SHRINK_ONEOF defined as
+// SHRINK_EXTERN_ONEOF.
+
+#ifdef SHRINK_INSTANTIATIONS
+#  define SHRINK_ONEOF SHRINK_INSTANTIATE_ONEOF
+#  include SHRINK_INSTANTIATIONS
+#  undef SHRINK_ONEOF
+#endif
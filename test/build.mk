@@ -1,10 +1,21 @@
 TESTS = shrink_TEST
+LIBRARIES = libshrink_test
 
-CPPFLAGS := -I$(SUBDIR)/../include -I$(GTEST_DIR)/include -I$(GTEST_DIR) -DGTEST_LANG_CXX11=1
+# The precompiled shrink/shrink.hh comes first, for the sources that start
+# by including it
+CPPFLAGS := -I$(SHRINK_PCH_DIR) -I$(SUBDIR)/../include -I$(GTEST_DIR)/include -I$(GTEST_DIR) -DGTEST_LANG_CXX11=1
 
-shrink_TEST_SOURCES = main.cc oneof.cc owned_ptr.cc gtest-all.cc
+shrink_TEST_SOURCES = main.cc oneof.cc oneof_range.cc oneof_arena.cc owned_ptr.cc shared_owned_ptr.cc instantiate.cc gtest-all.cc
 
-shrink_TEST_LIBRARIES = -lpthread
+# libshrink built again with the OneOfs from instantiate.hh, leaving the
+# real one as SHRINK_INSTANTIATIONS makes it
+libshrink_test_SOURCES = libshrink_test.cc
+
+shrink_TEST_LIBRARIES = libshrink_test -lpthread
+
+# Build the precompiled header before anything that should be compiled
+# through it
+$(SUBDIR)/instantiate.cc: | $(SHRINK_PCH)
 
 # hack!
 $(eval $(call add-dir,$(GENERATED_SOURCE_DIR)))
@@ -0,0 +1,29 @@
+// Included first so that this is compiled through the precompiled header
+#include <shrink/shrink.hh>
+
+#include "instantiate.hh"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using shrink::OneOf;
+using shrink::when;
+using namespace shrink::storage_policy;
+
+// Nothing in this file instantiates these OneOfs' nodes, so this only links
+// if libshrink was built with them
+TEST(InstantiateTest, ExternOneOfs)
+{
+    OneOf<int, std::string> o1(std::string("hello"));
+    OneOf<shared_storage, int, std::string, double> o2(o1);
+
+    ASSERT_EQ(5u, when(o2,
+            [](const int &) { return std::size_t(0); },
+            [](const std::string & s) { return s.length(); },
+            [](const double &) { return std::size_t(0); }
+        ));
+
+    o1 = 3;
+    ASSERT_EQ(0u, o1.index());
+}
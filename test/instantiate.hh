@@ -0,0 +1,21 @@
+#ifndef libshrink__test__instantiate_hh
+#define libshrink__test__instantiate_hh
+
+#include <shrink/instantiate.hh>
+
+#include <string>
+
+// libshrink_test.cc builds libshrink with SHRINK_INSTANTIATIONS naming this
+// header, which compiles these OneOfs into it. Everywhere else they're extern.
+#ifdef SHRINK_ONEOF
+#  define SHRINK_TEST_ONEOF SHRINK_ONEOF
+#else
+#  define SHRINK_TEST_ONEOF SHRINK_EXTERN_ONEOF
+#endif
+
+SHRINK_TEST_ONEOF(int, std::string)
+SHRINK_TEST_ONEOF(int, std::string, double)
+
+#undef SHRINK_TEST_ONEOF
+
+#endif
@@ -0,0 +1,5 @@
+// libshrink as the tests link it: src/shrink.cc with SHRINK_INSTANTIATIONS
+// naming the tests' OneOfs, so that libshrink itself is built without them.
+// The path is relative to src/shrink.cc, which includes it.
+#define SHRINK_INSTANTIATIONS "../test/instantiate.hh"
+#include "../src/shrink.cc"
@@ -1,7 +1,14 @@
 #include <shrink/oneof.hh>
 
+#include "instantiate.hh"
+
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
 using shrink::OneOf;
 using shrink::when;
 using namespace shrink::storage_policy;
@@ -158,3 +165,410 @@ TEST(OneOfTest, CloneStorage)
 }
 
 
+template <typename OneOf_>
+std::string describe(OneOf_ && o)
+{
+    return when(o,
+            [](const int & x) { return "int " + std::to_string(x); },
+            [](const double & x) { return "double " + std::to_string(x); },
+            [](const std::string & x) { return "string " + x; }
+        );
+}
+
+TEST(OneOfTest, Widening)
+{
+    OneOf<int, std::string> o1(std::string("hello"));
+    OneOf<std::string, double, int> o2(o1);
+
+    ASSERT_EQ("string hello", describe(o1));
+    ASSERT_EQ("string hello", describe(o2));
+
+    const std::string * held = when(o1,
+            [](const int &) -> const std::string * { return nullptr; },
+            [](const std::string & x) { return &x; }
+        );
+    OneOf<double, int, std::string> o3(std::move(o1));
+    ASSERT_EQ("string hello", describe(o3));
+    ASSERT_EQ(held, when(o3,
+            [](const double &) -> const std::string * { return nullptr; },
+            [](const int &) -> const std::string * { return nullptr; },
+            [](const std::string & x) { return &x; }
+        ));
+
+    o2 = OneOf<int, std::string>(5);
+    ASSERT_EQ("int 5", describe(o2));
+}
+
+namespace
+{
+    struct FragileMove
+    {
+        static bool fail;
+
+        int value;
+
+        explicit FragileMove(int v) : value(v) { }
+        FragileMove(const FragileMove &) = default;
+
+        FragileMove(FragileMove && other) : value(other.value)
+        {
+            if (fail)
+                throw std::runtime_error("FragileMove");
+        }
+    };
+
+    bool FragileMove::fail = false;
+}
+
+TEST(OneOfTest, WideningThrowingMove)
+{
+    OneOf<int, FragileMove> o1(FragileMove(3));
+    FragileMove::fail = true;
+
+    try
+    {
+        OneOf<double, int, FragileMove> o2(std::move(o1));
+        FAIL() << "Widening with a throwing move didn't throw";
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+
+    FragileMove::fail = false;
+    ASSERT_FALSE(o1.empty());
+    ASSERT_EQ(3, when(o1,
+            [](const int &) { return 0; },
+            [](const FragileMove & x) { return x.value; }
+        ));
+}
+
+TEST(OneOfTest, WideningLeavesSourceEmpty)
+{
+    OneOf<int, std::string> o1(std::string("hello"));
+    OneOf<double, int, std::string> o2(std::move(o1));
+    ASSERT_TRUE(o1.empty());
+
+    // Not rebuilt in place, since its move isn't noexcept
+    OneOf<int, FragileMove> o3(FragileMove(3));
+    OneOf<double, int, FragileMove> o4(std::move(o3));
+    ASSERT_TRUE(o3.empty());
+
+    OneOf<shared_storage, int, std::string> o5(std::string("hello"));
+    OneOf<shared_storage, int, std::string> shared(o5);
+    OneOf<shared_storage, double, int, std::string> o6(std::move(o5));
+    ASSERT_TRUE(o5.empty());
+    ASSERT_EQ("string hello", describe(shared));
+
+    o3 = FragileMove(4);
+    ASSERT_TRUE(shrink::try_convert(std::move(o3), o4));
+    ASSERT_TRUE(o3.empty());
+}
+
+TEST(OneOfTest, WideningSharedStorage)
+{
+    OneOf<shared_storage, int, std::string> o1(std::string("hello"));
+    OneOf<shared_storage, int, std::string> o2(o1);
+
+    OneOf<shared_storage, double, int, std::string> o3(std::move(o1));
+    ASSERT_EQ("string hello", describe(o3));
+    ASSERT_EQ("string hello", describe(o2));
+}
+
+TEST(OneOfTest, TryConvert)
+{
+    OneOf<int, std::string, double> o1(std::string("hello"));
+    OneOf<std::string, int> o2(0);
+
+    ASSERT_TRUE(shrink::try_convert(o1, o2));
+    ASSERT_EQ("string hello", describe(o2));
+
+    o1 = 1.5;
+    ASSERT_FALSE(shrink::try_convert(std::move(o1), o2));
+    ASSERT_EQ("double 1.500000", describe(o1));
+    ASSERT_EQ("string hello", describe(o2));
+
+    o1 = 7;
+    ASSERT_TRUE(shrink::try_convert(std::move(o1), o2));
+    ASSERT_EQ("int 7", describe(o2));
+}
+TEST(OneOfTest, Empty)
+{
+    OneOf<int, std::string> o1;
+    ASSERT_TRUE(o1.empty());
+
+    try
+    {
+        when(o1, [](int &) { }, [](std::string &) { });
+        FAIL() << "Visiting an empty OneOf didn't throw";
+    }
+    catch (const shrink::exceptions::EmptyOneOfException &)
+    {
+    }
+
+    int result = when(o1,
+            [](int & x) { return x; },
+            [](std::string &) { return 1; },
+            [](shrink::Empty) { return -1; }
+        );
+    ASSERT_EQ(-1, result);
+
+    o1 = 3;
+    ASSERT_FALSE(o1.empty());
+    ASSERT_EQ("int 3", describe(o1));
+
+    OneOf<int, std::string> o2(std::move(o1));
+    ASSERT_TRUE(o1.empty());
+    ASSERT_EQ("int 3", describe(o2));
+
+    o2.reset();
+    ASSERT_TRUE(o2.empty());
+
+    OneOf<double, int, std::string> o3(std::move(o2));
+    ASSERT_TRUE(o3.empty());
+}
+
+TEST(OneOfTest, EmptyInContainers)
+{
+    std::vector<OneOf<clone_storage, int, std::string> > v;
+    v.resize(16);
+    ASSERT_TRUE(v[15].empty());
+
+    v[3] = std::string("hello");
+    v.resize(64);
+    ASSERT_EQ("string hello", describe(v[3]));
+    ASSERT_TRUE(v[63].empty());
+}
+
+TEST(OneOfTest, Matcher)
+{
+    static const auto length = shrink::matcher(
+            [](const int & x) { return x; },
+            [](const std::string & x) { return int(x.length()); },
+            [](const double &) { return -1; },
+            [](shrink::Empty) { return 0; }
+        );
+
+    OneOf<int, std::string> o1(std::string("hello"));
+    const OneOf<std::string, double, int> o2(7);
+    OneOf<clone_storage, int, std::string> o3;
+
+    ASSERT_EQ(5, length(o1));
+    ASSERT_EQ(7, length(o2));
+    ASSERT_EQ(0, length(o3));
+
+    o1 = 3;
+    ASSERT_EQ(3, length(o1));
+
+    auto copy = length;
+    ASSERT_EQ(7, copy(o2));
+}
+
+TEST(OneOfTest, MatcherModifies)
+{
+    auto grow = shrink::matcher(
+            [](int & x) { x *= 2; },
+            [](std::string & x) { x += x; }
+        );
+
+    OneOf<int, std::string> o1(std::string("ab"));
+    grow(o1);
+    ASSERT_EQ("string abab", describe(o1));
+
+    o1 = 4;
+    grow(o1);
+    ASSERT_EQ("int 8", describe(o1));
+}
+
+template <typename OneOf_>
+const void * held_address(OneOf_ && o)
+{
+    return when(o,
+            [](const int & x) -> const void * { return &x; },
+            [](const double & x) -> const void * { return &x; },
+            [](const std::string & x) -> const void * { return &x; }
+        );
+}
+
+TEST(OneOfTest, AssignInPlace)
+{
+    OneOf<int, std::string> o1(std::string("hello"));
+    const void * held = held_address(o1);
+
+    o1 = std::string("world");
+    ASSERT_EQ("string world", describe(o1));
+    ASSERT_EQ(held, held_address(o1));
+
+    o1 = 3;
+    ASSERT_EQ("int 3", describe(o1));
+
+    OneOf<int, double, std::string> o2(5);
+    held = held_address(o2);
+    o2 = static_cast<const OneOf<int, std::string> &>(o1);
+    ASSERT_EQ("int 3", describe(o2));
+    ASSERT_EQ(held, held_address(o2));
+}
+
+TEST(OneOfTest, CopyAssignInPlace)
+{
+    OneOf<clone_storage, int, std::string> o1(std::string("hello"));
+    OneOf<clone_storage, int, std::string> o2(std::string("world"));
+    const void * held = held_address(o2);
+
+    o2 = o1;
+    ASSERT_EQ("string hello", describe(o2));
+    ASSERT_EQ(held, held_address(o2));
+
+    o1 = 4;
+    o2 = o1;
+    ASSERT_EQ("int 4", describe(o2));
+    ASSERT_EQ("string hello", describe(OneOf<clone_storage, int, std::string>(std::string("hello"))));
+}
+
+TEST(OneOfTest, SharedAssignment)
+{
+    OneOf<shared_storage, int, std::string> o1(std::string("hello"));
+    OneOf<shared_storage, int, std::string> o2(o1);
+
+    // o1's node is shared with o2, so this mustn't change o2
+    o1 = std::string("world");
+    ASSERT_EQ("string world", describe(o1));
+    ASSERT_EQ("string hello", describe(o2));
+
+    // Now it's unshared, so it can be assigned in place
+    const void * held = held_address(o1);
+    o1 = std::string("again");
+    ASSERT_EQ(held, held_address(o1));
+
+    o2 = o1;
+    ASSERT_EQ(held, held_address(o2));
+}
+
+TEST(OneOfTest, WhenLikely)
+{
+    OneOf<int, std::string> o1(std::string("hello"));
+
+    auto length = [&](const OneOf<int, std::string> & o) {
+        return shrink::when_likely<std::string>(o,
+                [](const int & x) { return x; },
+                [](const std::string & x) { return int(x.length()); },
+                [](shrink::Empty) { return -1; }
+            );
+    };
+
+    ASSERT_EQ(5, length(o1));
+    o1 = 3;
+    ASSERT_EQ(3, length(o1));
+    o1.reset();
+    ASSERT_EQ(-1, length(o1));
+
+    OneOf<Base, Derived1, Derived4> o2((Derived4(7)));
+    ASSERT_EQ(7, shrink::when_likely<Derived4>(o2, [](Base & b) { return b.f(); }));
+}
+
+TEST(OneOfTest, ProfiledMatcher)
+{
+    typedef OneOf<int, std::string, double> Message;
+
+    auto m = shrink::profiled_matcher<Message>(
+            [](const int & x) { return x; },
+            [](const std::string & x) { return int(x.length()); },
+            [](const double &) { return -1; },
+            [](shrink::Empty) { return 0; }
+        );
+
+    ASSERT_EQ(0u, m.likely_index());
+
+    Message s(std::string("hello")), i(3), d(1.5), e;
+    for (int n = 0; n < 1000000; ++n)
+        ASSERT_EQ(5, m(s));
+
+    ASSERT_EQ(1u, m.likely_index());
+    ASSERT_EQ(3, m(i));
+    ASSERT_EQ(-1, m(d));
+    ASSERT_EQ(0, m(e));
+
+    const Message & cs = s;
+    ASSERT_EQ(5, m(cs));
+
+    auto copy = m;
+    ASSERT_EQ(1u, copy.likely_index());
+
+    // Copies sample separately, even when calls alternate between them
+    auto m1 = copy, m2 = copy;
+    for (int n = 0; n < 1000000; ++n)
+    {
+        ASSERT_EQ(3, m1(i));
+        ASSERT_EQ(-1, m2(d));
+    }
+
+    ASSERT_EQ(0u, m1.likely_index());
+    ASSERT_EQ(2u, m2.likely_index());
+}
+
+namespace
+{
+    struct DataFrame { int length; };
+    struct Ping { int id; };
+    struct Close { int code; };
+
+    typedef OneOf<DataFrame, Ping, Close> Frame;
+
+    template <typename Func_>
+    double nanoseconds_per_call(const std::vector<Frame> & frames, Func_ func)
+    {
+        const int rounds = 2000;
+        volatile int sink = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; ++r)
+            for (const Frame & frame : frames)
+                sink = sink + func(frame);
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / (rounds * frames.size());
+    }
+}
+
+// Timings, so not run by default: run an optimised build with
+// --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+TEST(OneOfTest, DISABLED_ProfiledMatcherBenchmark)
+{
+    // 95% of frames hold the same type
+    std::vector<Frame> frames;
+    for (int i = 0; i < 4096; ++i)
+    {
+        int r = (i * 37) % 100;
+        if (r < 95)
+            frames.push_back(Frame(DataFrame{ r }));
+        else if (r < 98)
+            frames.push_back(Frame(Ping{ r }));
+        else
+            frames.push_back(Frame(Close{ r }));
+    }
+
+    auto m = shrink::matcher(
+            [](const DataFrame & d) { return d.length; },
+            [](const Ping & p) { return p.id; },
+            [](const Close & c) { return c.code; });
+
+    auto p = shrink::profiled_matcher<Frame>(
+            [](const DataFrame & d) { return d.length; },
+            [](const Ping & p) { return p.id; },
+            [](const Close & c) { return c.code; });
+
+    double matcher_ns = nanoseconds_per_call(frames, [&](const Frame & f) { return m(f); });
+    double profiled_ns = nanoseconds_per_call(frames, [&](const Frame & f) { return p(f); });
+    double likely_ns = nanoseconds_per_call(frames, [](const Frame & f) {
+            return shrink::when_likely<DataFrame>(f,
+                    [](const DataFrame & d) { return d.length; },
+                    [](const Ping & p) { return p.id; },
+                    [](const Close & c) { return c.code; });
+        });
+
+    std::printf("matcher %.2fns, profiled_matcher %.2fns, when_likely %.2fns per call\n",
+            matcher_ns, profiled_ns, likely_ns);
+
+    ASSERT_EQ(0u, p.likely_index());
+    EXPECT_LT(profiled_ns, matcher_ns);
+}
+
@@ -0,0 +1,181 @@
+#include <shrink/oneof_arena.hh>
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using shrink::OneOf;
+using shrink::oneof_arena;
+using shrink::when;
+using namespace shrink::storage_policy;
+
+namespace
+{
+    struct Literal
+    {
+        int value;
+    };
+
+    struct BinaryOp;
+
+    typedef OneOf<arena_storage, Literal, BinaryOp> Expr;
+
+    struct BinaryOp
+    {
+        char op;
+        Expr lhs, rhs;
+    };
+
+    int eval(const Expr & e)
+    {
+        return when(e,
+                [] (const Literal & l) { return l.value; },
+                [] (const BinaryOp & b) {
+                    int lhs = eval(b.lhs), rhs = eval(b.rhs);
+                    return b.op == '+' ? lhs + rhs : lhs * rhs;
+                });
+    }
+
+    struct Counted
+    {
+        std::string name;
+        int * destroyed;
+
+        ~Counted()
+        {
+            ++*destroyed;
+        }
+    };
+}
+
+TEST(OneOfArenaTest, RecursiveTree)
+{
+    oneof_arena arena;
+    oneof_arena::scope scope(arena);
+
+    // (2 + 3) * 4
+    Expr e = BinaryOp{ '*', BinaryOp{ '+', Literal{ 2 }, Literal{ 3 } }, Literal{ 4 } };
+    ASSERT_EQ(20, eval(e));
+
+    Expr copy = e;
+    e = Literal{ 1 };
+    ASSERT_EQ(1, eval(e));
+    ASSERT_EQ(20, eval(copy));
+}
+
+TEST(OneOfArenaTest, AllocationOrder)
+{
+    oneof_arena arena;
+    oneof_arena::scope scope(arena);
+
+    std::vector<OneOf<arena_storage, int, double> > v;
+    for (int i = 0; i < 100; ++i)
+        v.push_back(OneOf<arena_storage, int, double>(i));
+
+    for (std::size_t i = 1; i < v.size(); ++i)
+        ASSERT_LT(&v[i - 1].value(), &v[i].value());
+
+    // A reset rewinds to the start of the block, so the next node goes where
+    // the first one was
+    const void * first = &v[0].value();
+    v.clear();
+    arena.reset();
+
+    OneOf<arena_storage, int, double> again(1.5);
+    ASSERT_EQ(first, &again.value());
+}
+
+TEST(OneOfArenaTest, CleanupKeepsNodesContiguous)
+{
+    oneof_arena arena;
+    oneof_arena::scope scope(arena);
+
+    typedef OneOf<arena_storage, int, std::string> StringOrInt;
+    typedef shrink::oneof_internal::OneOfValue<std::string, int, std::string> Node;
+
+    std::vector<StringOrInt> v;
+    for (int i = 0; i < 300; ++i)
+        v.push_back(StringOrInt(std::string(i % 50, 'x')));
+
+    // Nothing but the nodes themselves in between, even across a new block
+    // of cleanup records
+    for (std::size_t i = 1; i < v.size(); ++i)
+        ASSERT_EQ(sizeof(Node), static_cast<std::size_t>(reinterpret_cast<const char *>(&v[i].value())
+                    - reinterpret_cast<const char *>(&v[i - 1].value())));
+}
+
+TEST(OneOfArenaTest, Cleanup)
+{
+    int destroyed = 0;
+
+    {
+        oneof_arena arena;
+        oneof_arena::scope scope(arena);
+
+        OneOf<arena_storage, int, Counted> o(Counted{ std::string(100, 'x'), &destroyed });
+        destroyed = 0;
+
+        o = 1;
+        ASSERT_EQ(0, destroyed);
+
+        arena.reset();
+        ASSERT_EQ(1, destroyed);
+
+        o = Counted{ "again", &destroyed };
+        destroyed = 0;
+    }
+
+    ASSERT_EQ(1, destroyed);
+}
+
+TEST(OneOfArenaTest, LargeAllocation)
+{
+    oneof_arena arena(256);
+    oneof_arena::scope scope(arena);
+
+    struct Large
+    {
+        char data[1024];
+    };
+
+    OneOf<arena_storage, int, Large> small_before(1), large(Large{ { 'a' } }), small_after(2);
+    ASSERT_EQ(1, when(small_before, [] (int i) { return i; }, [] (const Large &) { return 0; }));
+    ASSERT_EQ('a', when(large, [] (int) { return 0; }, [] (const Large & l) { return l.data[0]; }));
+    ASSERT_EQ(2, when(small_after, [] (int i) { return i; }, [] (const Large &) { return 0; }));
+}
+
+TEST(OneOfArenaTest, Scopes)
+{
+    ASSERT_EQ(nullptr, oneof_arena::current());
+    ASSERT_THROW((OneOf<arena_storage, int, double>(1)), shrink::exceptions::NoOneOfArenaException);
+
+    oneof_arena outer, inner;
+    oneof_arena::scope outer_scope(outer);
+    {
+        oneof_arena::scope inner_scope(inner);
+        ASSERT_EQ(&inner, oneof_arena::current());
+    }
+    ASSERT_EQ(&outer, oneof_arena::current());
+}
+
+TEST(OneOfArenaTest, Conversions)
+{
+    oneof_arena arena;
+    oneof_arena::scope scope(arena);
+
+    OneOf<arena_storage, int, std::string> a(std::string("hello"));
+
+    OneOf<int, std::string, double> heap(a);
+    ASSERT_EQ("hello", when(heap, [] (int) { return std::string(); }, [] (const std::string & s) { return s; },
+                [] (double) { return std::string(); }));
+
+    OneOf<arena_storage, int, std::string, double> wider(std::move(heap));
+    ASSERT_EQ(1u, wider.index());
+    ASSERT_TRUE(heap.empty());
+
+    // Arena nodes may be shared, so this copies, but still leaves a empty
+    OneOf<int, std::string, double> moved(std::move(a));
+    ASSERT_EQ(1u, moved.index());
+    ASSERT_TRUE(a.empty());
+}
@@ -0,0 +1,129 @@
+#include <shrink/oneof_range.hh>
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using shrink::OneOf;
+using shrink::when;
+
+TEST(OneOfRangeTest, Index)
+{
+    OneOf<int, std::string, double> o;
+    ASSERT_EQ(3u, o.index());
+
+    o = std::string("hello");
+    ASSERT_EQ(1u, o.index());
+
+    o = 1.5;
+    ASSERT_EQ(2u, o.index());
+}
+
+TEST(OneOfRangeTest, TagsOf)
+{
+    std::vector<OneOf<int, std::string> > v;
+    v.push_back(OneOf<int, std::string>(1));
+    v.push_back(OneOf<int, std::string>(std::string("a")));
+    v.push_back(OneOf<int, std::string>());
+
+    std::vector<std::uint8_t> tags(v.size());
+    ASSERT_EQ(tags.end(), shrink::tags_of(v, tags.begin()));
+    ASSERT_EQ(std::vector<std::uint8_t>({ 0, 1, 2 }), tags);
+}
+
+TEST(OneOfRangeTest, CountByType)
+{
+    // Enough values to cover several full vector blocks and a scalar tail
+    std::vector<OneOf<int, std::string, double> > v;
+    std::size_t expected[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 20000; ++i)
+    {
+        switch ((i * 7) % 11 % 4)
+        {
+            case 0: v.push_back(OneOf<int, std::string, double>(i)); ++expected[0]; break;
+            case 1: v.push_back(OneOf<int, std::string, double>(std::to_string(i))); ++expected[1]; break;
+            case 2: v.push_back(OneOf<int, std::string, double>(i * 0.5)); ++expected[2]; break;
+            case 3: v.push_back(OneOf<int, std::string, double>()); ++expected[3]; break;
+        }
+    }
+
+    auto counts = shrink::count_by_type(v);
+    ASSERT_EQ(4u, counts.size());
+    for (std::size_t b = 0; b < 4; ++b)
+        ASSERT_EQ(expected[b], counts[b]);
+}
+
+TEST(OneOfRangeTest, CountTagsManyBuckets)
+{
+    std::vector<std::uint8_t> tags;
+    for (int i = 0; i < 1000; ++i)
+        tags.push_back(i % 40);
+
+    std::vector<std::size_t> counts(40);
+    shrink::count_tags(tags.data(), tags.size(), counts.data(), counts.size());
+    for (std::size_t b = 0; b < 40; ++b)
+        ASSERT_EQ(b < 1000 % 40 ? 26u : 25u, counts[b]);
+}
+
+#ifdef SHRINK_ONEOF_RANGE_X86
+// count_tags() only runs the kernel this machine picks, so check each one
+// it could pick against the scalar loop
+TEST(OneOfRangeTest, CountTagsKernels)
+{
+    const std::size_t sizes[] = { 0, 1, 15, 16, 17, 31, 32, 33, 255 * 16, 255 * 32 + 7, 20000 };
+    const std::size_t bucket_counts[] = { 1, 4, 16 };
+
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2");
+
+    for (std::size_t n : sizes)
+    {
+        for (std::size_t buckets : bucket_counts)
+        {
+            std::vector<std::uint8_t> tags(n);
+            for (std::size_t i = 0; i < n; ++i)
+                tags[i] = (i * 7919 + i / 3) % buckets;
+
+            std::vector<std::size_t> expected(buckets), sse2(buckets), avx2_counts(buckets);
+            shrink::oneof_internal::count_tags_scalar(tags.data(), n, expected.data());
+
+            shrink::oneof_internal::count_tags_sse2(tags.data(), n, sse2.data(), buckets);
+            ASSERT_EQ(expected, sse2) << n << " tags in " << buckets << " buckets";
+
+            if (avx2)
+            {
+                shrink::oneof_internal::count_tags_avx2(tags.data(), n, avx2_counts.data(), buckets);
+                ASSERT_EQ(expected, avx2_counts) << n << " tags in " << buckets << " buckets";
+            }
+        }
+    }
+}
+#endif
+
+TEST(OneOfRangeTest, PartitionByType)
+{
+    std::vector<OneOf<int, std::string> > v;
+    v.push_back(OneOf<int, std::string>(std::string("a")));
+    v.push_back(OneOf<int, std::string>(1));
+    v.push_back(OneOf<int, std::string>());
+    v.push_back(OneOf<int, std::string>(std::string("b")));
+    v.push_back(OneOf<int, std::string>(2));
+
+    auto counts = shrink::partition_by_type(v);
+    ASSERT_EQ(2u, counts[0]);
+    ASSERT_EQ(2u, counts[1]);
+    ASSERT_EQ(1u, counts[2]);
+
+    std::vector<std::string> seen;
+    for (auto & o : v)
+        seen.push_back(when(o,
+                    [](int & x) { return std::to_string(x); },
+                    [](std::string & x) { return x; },
+                    [](shrink::Empty) { return std::string("empty"); }
+                ));
+    ASSERT_EQ(std::vector<std::string>({ "1", "2", "a", "b", "empty" }), seen);
+}
+
+// vim: set sw=4 sts=4 et :
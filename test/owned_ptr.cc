@@ -2,8 +2,15 @@
 
 #include <gtest/gtest.h>
 
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
 using shrink::owned_ptr;
 using shrink::handle_ptr;
+using shrink::handle_group;
+using shrink::weak_handle_ptr;
 using namespace shrink::exceptions;
 
 TEST(OwnedPtrTest, OwnedPtrTest)
@@ -201,4 +208,269 @@ TEST(OwnedPtrTest, DerefReleasedHandleThrows)
 
 
 
+struct Session
+{
+    int id;
+    std::string buffer;
+};
+
+TEST(OwnedPtrTest, AliasingHandles)
+{
+    owned_ptr<Session> p(new Session{1, "hello"});
+    handle_ptr<std::string> h(p, &p->buffer);
+
+    ASSERT_TRUE(h.good());
+    ASSERT_EQ("hello", *h);
+    ASSERT_EQ(5u, h->size());
+
+    try
+    {
+        p.release();
+        FAIL() << "Release with aliasing handles existing didn't throw";
+    }
+    catch (ReferencesStillExistException)
+    {
+    }
+
+    handle_ptr<std::string> h2(h);
+    h.release();
+    ASSERT_EQ("hello", *h2);
+
+    h2.release();
+    p.release();
+    ASSERT_FALSE(p.good());
+}
+
+TEST(OwnedPtrTest, AliasingHandleToReleasedPtrThrows)
+{
+    owned_ptr<Session> p(new Session{1, "hello"});
+    std::string * buffer = &p->buffer;
+    p.release();
+
+    try
+    {
+        handle_ptr<std::string> h(p, buffer);
+        FAIL() << "Creating an aliasing handle to a released pointer didn't throw";
+    }
+    catch (InvalidOwnedPtrException)
+    {
+    }
+}
+
+TEST(OwnedPtrTest, HandleGroups)
+{
+    owned_ptr<int> p(new int(3));
+
+    {
+        handle_group<int> g(p, 3);
+        ASSERT_EQ(3u, g.size());
+
+        handle_ptr<int> h1 = g.take();
+        handle_ptr<int> h2 = g.take();
+        ASSERT_EQ(1u, g.size());
+        ASSERT_EQ(3, *h1);
+
+        g.put(std::move(h2));
+        ASSERT_FALSE(h2.good());
+        ASSERT_EQ(2u, g.size());
+
+        g.release();
+        ASSERT_EQ(0u, g.size());
+
+        try
+        {
+            p.release();
+            FAIL() << "Release with a handle from a group existing didn't throw";
+        }
+        catch (ReferencesStillExistException)
+        {
+        }
+    }
+
+    p.release();
+    ASSERT_FALSE(p.good());
+}
+
+TEST(OwnedPtrTest, HandleGroupBlocksRelease)
+{
+    owned_ptr<Session> p(new Session{1, "hello"});
+    handle_group<std::string> g(p, &p->buffer, 2);
+
+    try
+    {
+        p.release();
+        FAIL() << "Release with a handle group existing didn't throw";
+    }
+    catch (ReferencesStillExistException)
+    {
+    }
+
+    ASSERT_EQ("hello", *g.take());
+    ASSERT_EQ("hello", *g.take());
+
+    try
+    {
+        g.take();
+        FAIL() << "Taking from an exhausted handle group didn't throw";
+    }
+    catch (EmptyHandleGroupException)
+    {
+    }
+
+    g.release();
+    p.release();
+}
+
+TEST(OwnedPtrTest, HandleGroupPutFromThreads)
+{
+    owned_ptr<int> p(new int(3));
+
+    {
+        handle_group<int> g(p, 8);
+
+        // Handles are taken on this thread only, but come back from all of
+        // them, to be taken again once the first lot runs out
+        for (int round = 0; round < 50; ++round)
+        {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 8; ++t)
+            {
+                handle_ptr<int> h = g.take();
+                threads.emplace_back([&g, h] () mutable {
+                        EXPECT_EQ(3, *h);
+                        g.put(std::move(h));
+                    });
+            }
+
+            for (std::thread & t : threads)
+                t.join();
+        }
+
+        ASSERT_EQ(8u, g.size());
+    }
+
+    p.release();
+    ASSERT_FALSE(p.good());
+}
+
+TEST(OwnedPtrTest, PutForeignHandleThrows)
+{
+    owned_ptr<int> p1(new int(3));
+    owned_ptr<int> p2(new int(4));
+    handle_group<int> g(p1, 1);
+    handle_ptr<int> h(p2);
+
+    try
+    {
+        g.put(std::move(h));
+        FAIL() << "Putting a foreign handle into a group didn't throw";
+    }
+    catch (ForeignHandlePtrException)
+    {
+    }
+
+    ASSERT_TRUE(h.good());
+}
+
+TEST(OwnedPtrTest, WeakHandles)
+{
+    owned_ptr<int> p(new int(3));
+    weak_handle_ptr<int> w(p);
+
+    ASSERT_FALSE(w.expired());
+
+    {
+        handle_ptr<int> h = w.lock();
+        ASSERT_TRUE(h.good());
+        ASSERT_EQ(3, *h);
+
+        try
+        {
+            p.release();
+            FAIL() << "Release with a handle from a weak handle existing didn't throw";
+        }
+        catch (ReferencesStillExistException)
+        {
+        }
+    }
+
+    weak_handle_ptr<int> w2(w);
+    p.release();
+
+    ASSERT_TRUE(w.expired());
+    ASSERT_TRUE(w2.expired());
+    ASSERT_FALSE(w.lock().good());
+}
+
+TEST(OwnedPtrTest, WeakHandlesOutliveOwner)
+{
+    std::unique_ptr<weak_handle_ptr<std::string> > w;
+
+    {
+        owned_ptr<Session> p(new Session{1, "hello"});
+        handle_ptr<std::string> h(p, &p->buffer);
+        w.reset(new weak_handle_ptr<std::string>(h));
+
+        ASSERT_EQ("hello", *w->lock());
+    }
+
+    ASSERT_TRUE(w->expired());
+    ASSERT_FALSE(w->lock().good());
+}
+
+TEST(OwnedPtrTest, WeakHandlesFollowMovedOwner)
+{
+    owned_ptr<int> p1(new int(3));
+    weak_handle_ptr<int> w(p1);
+
+    owned_ptr<int> p2(std::move(p1));
+    ASSERT_FALSE(p1.good());
+    ASSERT_FALSE(w.expired());
+    ASSERT_EQ(3, *w.lock());
+
+    p2 = owned_ptr<int>(new int(4));
+    ASSERT_TRUE(w.expired());
+}
+
+TEST(OwnedPtrTest, WeakHandlesLockDuringRelease)
+{
+    for (int round = 0; round < 200; ++round)
+    {
+        owned_ptr<int> * p = new owned_ptr<int>(new int(round));
+        weak_handle_ptr<int> w(*p);
+
+        // Keep locking until the object is gone, on a heap owned_ptr that's
+        // deleted as soon as it's released
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 3; ++t)
+            threads.emplace_back([w, round] () {
+                    for ( ; ; )
+                    {
+                        handle_ptr<int> h = w.lock();
+                        if (!h.good())
+                            break;
+                        EXPECT_EQ(round, *h);
+                    }
+                });
+
+        for ( ; ; )
+        {
+            try
+            {
+                p->release();
+                break;
+            }
+            catch (ReferencesStillExistException)
+            {
+            }
+        }
+        delete p;
+
+        for (std::thread & t : threads)
+            t.join();
+
+        ASSERT_TRUE(w.expired());
+    }
+}
+
 // vim: set sw=4 sts=4 et :
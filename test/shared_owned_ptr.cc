@@ -0,0 +1,303 @@
+#include <shrink/shared_owned_ptr.hh>
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using shrink::shared_segment;
+using shrink::shared_owned_ptr;
+using shrink::shared_handle_ptr;
+using shrink::offset_ptr;
+using namespace shrink::exceptions;
+
+namespace
+{
+    struct Table
+    {
+        int values[16];
+    };
+
+    // Runs child in a forked process, which exits with child's result
+    template <typename Child_>
+    pid_t fork_child(Child_ child)
+    {
+        pid_t pid = ::fork();
+        if (pid == 0)
+            ::_exit(child());
+        return pid;
+    }
+
+    int wait_child(pid_t pid)
+    {
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    struct Pipe
+    {
+        int fds[2];
+
+        Pipe() { if (::pipe(fds) != 0) throw std::runtime_error("pipe"); }
+        ~Pipe() { ::close(fds[0]); ::close(fds[1]); }
+
+        void signal() { char c = 0; ASSERT_EQ(1, ::write(fds[1], &c, 1)); }
+        void wait() { char c; ASSERT_EQ(1, ::read(fds[0], &c, 1)); }
+    };
+}
+
+TEST(SharedOwnedPtrTest, SharedOwnedPtrTest)
+{
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+    p->values[3] = 42;
+
+    shared_handle_ptr<Table> h(segment, p.offset());
+    ASSERT_EQ(42, h->values[3]);
+
+    try
+    {
+        p.release();
+        FAIL() << "Release with handles existing didn't throw";
+    }
+    catch (ReferencesStillExistException)
+    {
+    }
+
+    h.release();
+    p.release();
+    ASSERT_FALSE(p.good());
+}
+
+TEST(SharedOwnedPtrTest, HandlesFromOtherProcesses)
+{
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+    p->values[0] = 7;
+
+    Pipe acquired, done;
+    pid_t child = fork_child([&] {
+        shared_handle_ptr<Table> h(segment, p.offset());
+        int result = h->values[0] == 7 ? 0 : 1;
+        h->values[1] = 8;
+        acquired.signal();
+        done.wait();
+        h.release();
+        return result;
+    });
+
+    acquired.wait();
+    ASSERT_EQ(8, p->values[1]);
+
+    try
+    {
+        p.release();
+        FAIL() << "Release with another process's handles existing didn't throw";
+    }
+    catch (ReferencesStillExistException)
+    {
+    }
+
+    done.signal();
+    ASSERT_EQ(0, wait_child(child));
+
+    p.release();
+    ASSERT_FALSE(p.good());
+}
+
+TEST(SharedOwnedPtrTest, RecoverFromDeadProcess)
+{
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+
+    pid_t child = fork_child([&] {
+        // Exits without releasing, as if it had crashed
+        new shared_handle_ptr<Table>(segment, p.offset());
+        return 0;
+    });
+    ASSERT_EQ(0, wait_child(child));
+
+    try
+    {
+        p.release();
+        FAIL() << "Release with a dead process's handles existing didn't throw";
+    }
+    catch (ReferencesStillExistException)
+    {
+    }
+
+    ASSERT_EQ(1u, p.recover());
+    p.release();
+}
+
+TEST(SharedOwnedPtrTest, RecoverFromReusedPid)
+{
+    using namespace shrink::shared_owned_ptr_internal;
+
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+
+    // A lease left by a process that crashed, and whose pid is now ours
+    ProcessKey self = self_key();
+    ASSERT_NE(0u, self >> 32);
+    SharedControl & control = *static_cast<SharedControl *>(segment.at(p.offset()));
+    control.lease[0].owner = self ^ (ProcessKey(1) << 32);
+    control.lease[0].count = 1;
+
+    {
+        shared_handle_ptr<Table> h(p);
+        ASSERT_EQ(self, control.lease[1].owner);
+        ASSERT_EQ(1u, control.lease[0].count);
+    }
+
+    try
+    {
+        p.release();
+        FAIL() << "Release with a dead process's handles existing didn't throw";
+    }
+    catch (ReferencesStillExistException)
+    {
+    }
+
+    ASSERT_EQ(1u, p.recover());
+    ASSERT_EQ(0u, control.lease[0].owner);
+    p.release();
+}
+
+TEST(SharedOwnedPtrTest, HandleAfterOwnerDiedReleasing)
+{
+    using namespace shrink::shared_owned_ptr_internal;
+
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+    p->values[0] = 7;
+
+    // As if the object had been made by a process that crashed partway
+    // through releasing it
+    pid_t child = fork_child([] { return 0; });
+    ASSERT_EQ(0, wait_child(child));
+
+    SharedControl & control = *static_cast<SharedControl *>(segment.at(p.offset()));
+    ProcessKey owner = control.owner;
+    control.owner = static_cast<std::uint32_t>(child);
+    control.state = releasing;
+
+    {
+        shared_handle_ptr<Table> h(segment, p.offset());
+        ASSERT_EQ(7, h->values[0]);
+        ASSERT_EQ(std::uint32_t(alive), control.state);
+    }
+
+    control.owner = owner;
+    p.release();
+}
+
+TEST(SharedOwnedPtrTest, HandleToReleasedObjectThrows)
+{
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+    std::size_t offset = p.offset();
+    p.release();
+
+    try
+    {
+        shared_handle_ptr<Table> h(segment, offset);
+        FAIL() << "Taking a handle to a released object didn't throw";
+    }
+    catch (InvalidOwnedPtrException)
+    {
+    }
+}
+
+TEST(SharedOwnedPtrTest, HandlesDuringFailedRelease)
+{
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Table> p(segment);
+    shared_handle_ptr<Table> h(p);
+
+    // Every release attempt fails while h exists, so the child must never
+    // be refused a handle even though it keeps seeing those attempts
+    pid_t pid = fork_child([&] () {
+            try
+            {
+                for (int i = 0; i < 200000; ++i)
+                    shared_handle_ptr<Table> child(segment, p.offset());
+            }
+            catch (InvalidOwnedPtrException)
+            {
+                return 1;
+            }
+            return 0;
+        });
+
+    int status = 0;
+    while (::waitpid(pid, &status, WNOHANG) == 0)
+    {
+        try
+        {
+            p.release();
+            FAIL() << "Release with a handle existing didn't throw";
+        }
+        catch (ReferencesStillExistException)
+        {
+        }
+    }
+
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    h.release();
+    p.release();
+}
+
+TEST(SharedOwnedPtrTest, OpenTooSmallSegmentThrows)
+{
+    std::string name = "/shrink_test_small_" + std::to_string(::getpid());
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(0, ::ftruncate(fd, 8));
+    ::close(fd);
+
+    // The lowest free descriptor is the same afterwards if none leaked
+    int before = ::dup(0);
+    ::close(before);
+
+    try
+    {
+        shared_segment segment = shared_segment::open(name);
+        FAIL() << "Opening a segment too small for a header didn't throw";
+    }
+    catch (InvalidSharedSegmentException)
+    {
+    }
+
+    int after = ::dup(0);
+    ::close(after);
+    shared_segment::unlink(name);
+
+    ASSERT_EQ(before, after);
+}
+
+TEST(SharedOwnedPtrTest, OffsetPtr)
+{
+    struct Node
+    {
+        int value;
+        offset_ptr<Node> next;
+    };
+
+    shared_segment segment = shared_segment::create(4096);
+    shared_owned_ptr<Node> first(segment), second(segment);
+
+    first->value = 1;
+    second->value = 2;
+    first->next = &*second;
+
+    ASSERT_EQ(2, first->next->value);
+    ASSERT_FALSE(second->next);
+}
+
+// vim: set sw=4 sts=4 et :